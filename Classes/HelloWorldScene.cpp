@@ -2,6 +2,8 @@
 #include "SimpleAudioEngine.h"
 #include "async_tiled.h"
 #include "fractals.h"
+#include <algorithm>
+#include <numeric>
 #include <iostream> /// < Only for debug output
 
 USING_NS_CC;
@@ -13,7 +15,8 @@ Scene* HelloWorld::createScene()
     return HelloWorld::create();
 }
 
-void clear(std::vector<async_tiled::RGBA>& buffer, const async_tiled::RGBA colour)
+template<typename PixelType>
+void clear(std::vector<PixelType>& buffer, const PixelType colour)
 {
     for(auto&& pixel : buffer)
     {
@@ -21,6 +24,30 @@ void clear(std::vector<async_tiled::RGBA>& buffer, const async_tiled::RGBA colou
     }
 }
 
+/** A colour in a tile pixel format, for the placeholder checkerboard. Iteration counts show it as zero. */
+template<typename PixelType>
+PixelType placeholderPixel(const async_tiled::RGBA colour)
+{
+    return PixelType(colour);
+}
+template<>
+async_tiled::U16 placeholderPixel<async_tiled::U16>(const async_tiled::RGBA)
+{
+    return async_tiled::U16(0);
+}
+
+/** The texture format tiles of a pixel format upload to. Counts go up as two bytes for a palette shader to read. */
+Texture2D::PixelFormat texturePixelFormat(const async_tiled::TileFormat format)
+{
+    switch(format) {
+        case async_tiled::TileFormat::RGBA8888: return Texture2D::PixelFormat::RGBA8888;
+        case async_tiled::TileFormat::I8:       return Texture2D::PixelFormat::I8;
+        case async_tiled::TileFormat::RGB565:   return Texture2D::PixelFormat::RGB565;
+        case async_tiled::TileFormat::U16:      return Texture2D::PixelFormat::AI88;
+    }
+    return Texture2D::PixelFormat::RGBA8888;
+}
+
 void positionTileSprite(Sprite* const tileSprite, double tileWidthWorld, double tileWidthLogical, double tileHeightWorld, double tileHeightLogical, double gridOriginWorldX, double gridX, double gridOriginWorldY, double gridY, bool visible)
 {
     if(tileSprite)
@@ -33,25 +60,77 @@ void positionTileSprite(Sprite* const tileSprite, double tileWidthWorld, double
 }
 
 /**
- * Sets the geometry of the grid of tiles to cover a region of interest in the complex plane.
+ * How many tiles the grids of tile sprites have: enough to cover the screen
+ * from a corner anywhere within a tile of its bottom left, as the grids are
+ * snapped to world tiles.
  */
-void fitTileGridToRegion(const Size visibleSize, float pixelScale, Array2D<Sprite*>& tileSprites, unsigned tileDimsXY, const Region2D& tiledRegion, bool visible)
+async_tiled::Dims2U tileSpriteGridDims(const Size visibleSize, float pixelScale, unsigned tileDimsXY)
+{
+    const auto tileWidthLogical = (tileDimsXY>>16u) / pixelScale;
+    const auto tileHeightLogical = (tileDimsXY & 65535u) / pixelScale;
+    return {unsigned(ceilf(visibleSize.width / tileWidthLogical)) + 1u, unsigned(ceilf(visibleSize.height / tileHeightLogical)) + 1u};
+}
+
+/**
+ * Snaps a grid of tiles to the world tiles under a region of the complex plane.
+ * The region must be a power of two pixels wide in world units, as init() and
+ * the 2x zooms keep it.
+ */
+WorldTileGrid placeWorldTiles(const Region2D& region, const Size trueSize, const unsigned tileDims, const async_tiled::Dims2U gridDims)
+{
+    const int log2PixelSize = int(std::lround(std::log2(region.width / trueSize.width)));
+    const int log2TileSize = log2PixelSize + int(std::lround(std::log2(double(tileDims))));
+    assert(std::ldexp(1.0, log2TileSize - log2PixelSize) == tileDims);
+    const async_tiled::Coordinate left = region.centreX - async_tiled::Coordinate(region.width * 0.5);
+    const async_tiled::Coordinate bottom = region.centreY - async_tiled::Coordinate(region.height * 0.5);
+
+    WorldTileGrid grid;
+    grid.origin = {-log2TileSize, async_tiled::floorDivPowerOfTwo(left, log2TileSize), async_tiled::floorDivPowerOfTwo(bottom, log2TileSize)};
+    grid.dims = gridDims;
+    const async_tiled::Coordinate cornerX = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(grid.origin.x, log2TileSize);
+    const async_tiled::Coordinate cornerY = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(grid.origin.y, log2TileSize);
+    grid.viewOffset = {float(std::ldexp(double(left - cornerX), -log2PixelSize)), float(std::ldexp(double(bottom - cornerY), -log2PixelSize))};
+    return grid;
+}
+
+/**
+ * Moves a region the least distance that puts its centre on the lattice of
+ * pixels, so after a pan the pixels still on screen are where they were
+ * sampled and can be kept.
+ * @return How far the centre moved, in world units.
+ */
+Vec2 snapToPixels(Region2D& region, const Size trueSize)
+{
+    const int log2PixelSize = int(std::lround(std::log2(region.width / trueSize.width)));
+    const async_tiled::Coordinate halfPixel(std::ldexp(0.5, log2PixelSize));
+    const async_tiled::Coordinate snappedX = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(async_tiled::floorDivPowerOfTwo(region.centreX + halfPixel, log2PixelSize), log2PixelSize);
+    const async_tiled::Coordinate snappedY = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(async_tiled::floorDivPowerOfTwo(region.centreY + halfPixel, log2PixelSize), log2PixelSize);
+    const Vec2 moved(float(double(snappedX - region.centreX)), float(double(snappedY - region.centreY)));
+    region.centreX = snappedX;
+    region.centreY = snappedY;
+    return moved;
+}
+
+/**
+ * Sets the geometry of the grid of tiles to cover its world tiles.
+ */
+void fitTileGridToRegion(const Size visibleSize, float pixelScale, Array2D<Sprite*>& tileSprites, unsigned tileDimsXY, const WorldTileGrid& worldTiles, bool visible)
 {
     const auto tileWidth = tileDimsXY>>16u;
     const auto tileHeight = tileDimsXY & 65535u;
     const auto tileWidthLogical = tileWidth / pixelScale;
     const auto tileHeightLogical = tileHeight / pixelScale;
 
-    const unsigned tilesX = ceilf(visibleSize.width / tileWidthLogical);
-    const unsigned tilesY = ceilf(visibleSize.height / tileHeightLogical);
+    const unsigned tilesX = tileSprites.width();
+    const unsigned tilesY = tileSprites.height();
 
-    assert(tileSprites.width() == tilesX && tileSprites.height() == tilesY);
+    assert(worldTiles.dims.w == tilesX && worldTiles.dims.h == tilesY);
 
     // How big tiles are in worldspace:
-    const double tileWidthWorld = tiledRegion.width / tilesX;
-    const double tileHeightWorld = tiledRegion.height / tilesY;
-    const double gridOriginWorldX = tiledRegion.centreX - tiledRegion.width * 0.5;
-    const double gridOriginWorldY = tiledRegion.centreY - tiledRegion.height * 0.5;
+    const double tileWidthWorld = std::ldexp(1.0, -worldTiles.origin.level);
+    const double tileHeightWorld = tileWidthWorld;
+    const double gridOriginWorldX = std::ldexp(double(worldTiles.origin.x), -worldTiles.origin.level);
+    const double gridOriginWorldY = std::ldexp(double(worldTiles.origin.y), -worldTiles.origin.level);
 
     for(unsigned gridY = 0; gridY < tilesY; ++gridY)
     {
@@ -65,40 +144,79 @@ void fitTileGridToRegion(const Size visibleSize, float pixelScale, Array2D<Sprit
 
 /**
  * Builds a grid of tile-sized sprites covering the screen.
+ * With USE_TILE_ATLAS the sprites are rectangles of one texture, with tile
+ * (x, y) at texel (x, y) times the tile size, and are drawn as one batch.
+ * @param[out] tileAtlas That texture, or null if each sprite has its own.
  */
-Node* buildTileGrid(const Size visibleSize, float pixelScale, Vec2 origin, Array2D<Sprite*>& tileSprites, unsigned tileDimsXY, const Region2D& tiledRegion)
+Node* buildTileGrid(const Size visibleSize, float pixelScale, Vec2 origin, Array2D<Sprite*>& tileSprites, unsigned tileDimsXY, const WorldTileGrid& worldTiles, Texture2D*& tileAtlas)
 {
     const auto tileWidth = tileDimsXY>>16u;
     const auto tileHeight = tileDimsXY & 65535u;
     const auto tileWidthLogical = tileWidth / pixelScale;
     const auto tileHeightLogical = tileHeight / pixelScale;
 
-    auto tileGrid = Node::create();
-    const unsigned tilesX = ceilf(visibleSize.width / tileWidthLogical);
-    const unsigned tilesY = ceilf(visibleSize.height / tileHeightLogical);
+    const unsigned tilesX = worldTiles.dims.w;
+    const unsigned tilesY = worldTiles.dims.h;
+    auto checkerColour = [](const unsigned gridX, const unsigned gridY) {
+        return placeholderPixel<TilePixel>(((gridX & 1u) & (gridY & 1)) || (((gridX & 1u) == 0) & ((gridY & 1) == 0)) ? async_tiled::RGBA(255, 0, 0, 255) : async_tiled::RGBA(0, 255, 0, 255));
+    };
+
+    Node* tileGrid = nullptr;
+    tileAtlas = nullptr;
+    const unsigned atlasWidth = tilesX * tileWidth;
+    const unsigned atlasHeight = tilesY * tileHeight;
+    const unsigned maxTextureSize = unsigned(Configuration::getInstance()->getMaxTextureSize());
+    if(USE_TILE_ATLAS && atlasWidth <= maxTextureSize && atlasHeight <= maxTextureSize)
+    {
+        // Clear a red/green checkerboard:
+        std::vector<TilePixel> atlasPixels(size_t(atlasWidth) * atlasHeight);
+        for(unsigned y = 0; y < atlasHeight; ++y)
+        {
+            for(unsigned x = 0; x < atlasWidth; ++x)
+            {
+                atlasPixels[size_t(y) * atlasWidth + x] = checkerColour(x / tileWidth, y / tileHeight);
+            }
+        }
+        tileAtlas = new Texture2D;
+        tileAtlas->initWithData(atlasPixels.data(), atlasPixels.size() * sizeof(TilePixel), texturePixelFormat(TilePixel::format), atlasWidth, atlasHeight, Size(atlasWidth, atlasHeight));
+        tileAtlas->autorelease();
+        tileGrid = SpriteBatchNode::createWithTexture(tileAtlas, tilesX * tilesY);
+    }
+    else
+    {
+        tileGrid = Node::create();
+    }
     // const float spriteScaleX = tileWidth / tileSprite->
     //Array2D<Sprite*> tileSprites(tilesX, tilesY);
     tileSprites.resize(tilesX, tilesY);
-    std::vector<async_tiled::RGBA> tileBuffer;
+    std::vector<TilePixel> tileBuffer;
     tileBuffer.resize(tileWidth * tileHeight);
 
     // How big tiles are in worldspace:
-    const double tileWidthWorld = tiledRegion.width / tilesX;
-    const double tileHeightWorld = tiledRegion.height / tilesY;
-    const double gridOriginWorldX = tiledRegion.centreX - tiledRegion.width * 0.5;
-    const double gridOriginWorldY = tiledRegion.centreY - tiledRegion.height * 0.5;
+    const double tileWidthWorld = std::ldexp(1.0, -worldTiles.origin.level);
+    const double tileHeightWorld = tileWidthWorld;
+    const double gridOriginWorldX = std::ldexp(double(worldTiles.origin.x), -worldTiles.origin.level);
+    const double gridOriginWorldY = std::ldexp(double(worldTiles.origin.y), -worldTiles.origin.level);
 
     for(unsigned gridY = 0; gridY < tilesY; ++gridY)
     {
         for(unsigned gridX = 0; gridX < tilesX; ++ gridX)
         {
-            // Clear a red/green checkerboard:
-            clear(tileBuffer, ((gridX & 1u) & (gridY & 1)) || (((gridX & 1u) == 0) & ((gridY & 1) == 0)) ? async_tiled::RGBA(255, 0, 0, 255) : async_tiled::RGBA(0, 255, 0, 255));
-            auto texture = new Texture2D;
-            texture->initWithData(tileBuffer.data(), tileWidth * tileHeight * sizeof(async_tiled::RGBA), Texture2D::PixelFormat::RGBA8888, tileWidth, tileHeight, Size(tileWidth * pixelScale, tileHeight * pixelScale));
-            auto tileSprite =
-              //Sprite::create("tile_blue.png");//"HelloWorld.png");
-              Sprite::createWithTexture(texture);
+            Sprite* tileSprite = nullptr;
+            if(tileAtlas)
+            {
+                tileSprite = Sprite::createWithTexture(tileAtlas, Rect(gridX * tileWidthLogical, gridY * tileHeightLogical, tileWidthLogical, tileHeightLogical));
+            }
+            else
+            {
+                // Clear a red/green checkerboard:
+                clear(tileBuffer, checkerColour(gridX, gridY));
+                auto texture = new Texture2D;
+                texture->initWithData(tileBuffer.data(), tileWidth * tileHeight * sizeof(TilePixel), texturePixelFormat(TilePixel::format), tileWidth, tileHeight, Size(tileWidth * pixelScale, tileHeight * pixelScale));
+                tileSprite =
+                  //Sprite::create("tile_blue.png");//"HelloWorld.png");
+                  Sprite::createWithTexture(texture);
+            }
             tileSprites[gridY][gridX] = tileSprite;
             if(tileSprite)
             {
@@ -116,16 +234,98 @@ Node* buildTileGrid(const Size visibleSize, float pixelScale, Vec2 origin, Array
 }
 
 // Run on GUI thread
-void generateTiles(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const uint16_t transaction, std::atomic<uint16_t>& newestTransaction, const unsigned tileDims, const Size trueSize)
+/**
+ * Uploads a rectangle of finished tiles with one call and shows them, or drops
+ * them if cancelled, and hands back their staging slots.
+ * Which grids are drawn is left to HelloWorld::arrangeLevels().
+ */
+void uploadTiles(const TileUpload& upload, async_tiled::StagingRing& uploadStaging, UploadStats& stats)
+{
+    ZoomLevel& zoomLevel = *upload.zoomLevel;
+    const unsigned tiles = unsigned(upload.w) * upload.h;
+    if(!upload.cancellation->cancelled())
+    {
+        // The waiter packed the rectangle's rows together, so they go straight up:
+        const void* const pixels = uploadStaging.data(upload.staging.slot);
+        if(zoomLevel.tileAtlas)
+        {
+            zoomLevel.tileAtlas->updateWithData(pixels, upload.x * TILE_DIMS, upload.y * TILE_DIMS, upload.w * TILE_DIMS, upload.h * TILE_DIMS);
+        }
+        else
+        {
+            assert(tiles == 1 && "Only tiles of an atlas are merged.");
+            zoomLevel.tileSprites[upload.y][upload.x]->getTexture()->updateWithData(pixels, 0, 0, TILE_DIMS, TILE_DIMS);
+        }
+        ++stats.calls;
+        stats.bytes += tiles * TILE_DIMS * TILE_DIMS * sizeof(TilePixel);
+        stats.tiles += tiles;
+        for(unsigned y = upload.y; y < unsigned(upload.y + upload.h); ++y)
+        {
+            for(unsigned x = upload.x; x < unsigned(upload.x + upload.w); ++x)
+            {
+                zoomLevel.tileSprites[y][x]->setVisible(true);
+            }
+        }
+        zoomLevel.tilesUpdated += tiles;
+    }
+    else{
+        std::cerr << "Skipped updating " << tiles << " tiles as their zoom has been cancelled" << std::endl;
+    }
+    uploadStaging.release(upload.staging);
+    assert(zoomLevel.tilesInFlight >= tiles);
+    zoomLevel.tilesInFlight -= std::min<uint32_t>(tiles, zoomLevel.tilesInFlight);
+}
+
+// Run on GUI thread
+void generateTiles(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const std::shared_ptr<async_tiled::CancellationToken> cancellation, async_tiled::BoundedMpscQueue<TileUpload>& tileReady, async_tiled::StagingRing& uploadStaging, async_tiled::TileCache<TilePixel>& tileCache, async_tiled::TileStore<TilePixel>& tileStore, const unsigned tileDims, const Size trueSize)
 {
-    // If any existing background tasks are accessing zoomLevel, this will cause them
-    // to abort themselves:
-    zoomLevel.zoomTransaction = transaction;
     zoomLevel.tilesUpdated = 0;
+    const WorldTileGrid worldTiles = zoomLevel.worldTiles;
+    // Zooms and pans keep the centre of the viewport where the user is looking:
+    zoomLevel.schedule->setFocus({worldTiles.viewOffset.x + trueSize.width * 0.5f, worldTiles.viewOffset.y + trueSize.height * 0.5f});
+
+    const size_t tileCount = size_t(worldTiles.dims.w) * worldTiles.dims.h;
+    if(!zoomLevel.tileSamples)
+    {
+        zoomLevel.tileSamples.reset(new std::atomic<uint32_t>[tileCount]());
+    }
+    const uint32_t generation = ++zoomLevel.launchGeneration;
+    // The launch which took this level as the one before it may still be reading its pixels and samples, so is waited for before they are overwritten:
+    const std::shared_ptr<async_tiled::CancellationToken> readingThis = zoomLevel.readerCancellation;
+    zoomLevel.launchCancellation = cancellation;
+    lastZoomLevel.readerCancellation = cancellation;
+
+    // A pan keeps the zoom, so the finished tiles of the level before still on
+    // screen are copied, leaving only the newly exposed strips to iterate:
+    const WorldTileGrid& lastTiles = lastZoomLevel.worldTiles;
+    const bool panned = worldTiles.origin.level == lastTiles.origin.level && lastZoomLevel.tileSamples &&
+                        lastTiles.dims.w == worldTiles.dims.w && lastTiles.dims.h == worldTiles.dims.h;
+    const uint32_t lastGeneration = lastZoomLevel.launchGeneration;
+
+    // After a 2x zoom in a quarter of the pixels are at the same place in the world
+    // as ones of the level above, so the samples of its finished tiles are reused:
+    async_tiled::CoarseSamples seed;
+    const WorldTileGrid& coarseTiles = lastZoomLevel.worldTiles;
+    const int64_t seedOffsetX = (worldTiles.origin.x - 2 * coarseTiles.origin.x) * int64_t(tileDims / 2);
+    const int64_t seedOffsetY = (worldTiles.origin.y - 2 * coarseTiles.origin.y) * int64_t(tileDims / 2);
+    if(worldTiles.origin.level == coarseTiles.origin.level + 1 && lastZoomLevel.tileSamples && tileDims % 2 == 0 &&
+       std::abs(seedOffsetX) < (int64_t(1) << 30) && std::abs(seedOffsetY) < (int64_t(1) << 30))
+    {
+        seed.iterations = &lastZoomLevel.iterations;
+        seed.offsetX = int(seedOffsetX);
+        seed.offsetY = int(seedOffsetY);
+        const std::atomic<uint32_t>* const coarseSamples = lastZoomLevel.tileSamples.get();
+        const uint32_t finished = 2 * lastGeneration;
+        const unsigned coarseGridWidth = coarseTiles.dims.w;
+        seed.finished = [coarseSamples, finished, coarseGridWidth, tileDims](const unsigned x, const unsigned y) -> bool
+        {
+            return coarseSamples[(y / tileDims) * coarseGridWidth + x / tileDims].load(std::memory_order_acquire) == finished;
+        };
+    }
 
     // Populate the tiles with areas of the mandlebrot set on a background thread:
     std::future<bool> launchStatus =
-    async_tiled::LaunchAsync([tileDims, trueSize, &zoomLevel, transaction, &newestTransaction, &lastZoomLevel]() -> bool
+    async_tiled::LaunchAsync([tileDims, worldTiles, &zoomLevel, cancellation, &lastZoomLevel, &tileReady, &uploadStaging, &tileCache, &tileStore, generation, readingThis, seed, panned, lastTiles, lastGeneration]() -> bool
     {
         // Only one launcher / waiter task should run at a time:
         std::lock_guard<std::mutex> lock(zoomLevel.launcherLock);
@@ -134,7 +334,7 @@ void generateTiles(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const uint16_
         // we will reuse in this new background tiled render:
         do {
             // Early out if subsequent zooms have happened since this one was launched:
-            if(newestTransaction != transaction)
+            if(cancellation->cancelled())
             {
                 return false;
             }
@@ -145,83 +345,139 @@ void generateTiles(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const uint16_
             }
         }
         while(true);
+        if(readingThis)
+        {
+            readingThis->waitQuiesced();
+        }
 
         std::vector<async_tiled::Tile2D>& tiles = zoomLevel.tiles;
         // Size a framebuffer to hold all the tile pixels, even off edge of screen:
-        async_tiled::Framebuffer& framebuffer = zoomLevel.framebuffer;
-        const unsigned framebufferWidth = zoomLevel.tileSprites.width() * tileDims;
-        const unsigned framebufferHeight = zoomLevel.tileSprites.height() * tileDims;
-        framebuffer.resize(framebufferWidth * framebufferHeight); ///@ToDo < round up to a multiple of a cacheline to avoid false sharing of cachelines across tiles.
-        async_tiled::TileSpec spec = {
-            async_tiled::TileFormat::RGBA8888,
-            uint16_t(tileDims),
-            uint16_t(tileDims),
-            unsigned(trueSize.width * sizeof(async_tiled::RGBA))
+        async_tiled::PaddedFramebuffer<TilePixel>& framebuffer = zoomLevel.framebuffer;
+        const async_tiled::Dims2U tileGridDims = worldTiles.dims;
+        const async_tiled::Dims2U framebufferDims = {tileGridDims.w * tileDims, tileGridDims.h * tileDims};
+        framebuffer.resize(framebufferDims);
+        // Tiles are rendered bottom-up, the way textures take them, so they upload without flipping:
+        const async_tiled::TileSpec spec = framebuffer.tileSpec({tileDims, tileDims}, async_tiled::RowOrder::BottomUp);
+        if(zoomLevel.iterations.dims.w != framebufferDims.w || zoomLevel.iterations.dims.h != framebufferDims.h)
+        {
+            zoomLevel.iterations = async_tiled::IterationBuffer(framebufferDims, false);
+        }
+        // The framebuffer covers exactly its world tiles:
+        const int log2TileSize = -worldTiles.origin.level;
+        const double spanX = std::ldexp(double(tileGridDims.w), log2TileSize);
+        const double spanY = std::ldexp(double(tileGridDims.h), log2TileSize);
+        const async_tiled::Coordinate centreX = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(worldTiles.origin.x, log2TileSize) + async_tiled::Coordinate(spanX * 0.5);
+        const async_tiled::Coordinate centreY = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(worldTiles.origin.y, log2TileSize) + async_tiled::Coordinate(spanY * 0.5);
+        // Tiles kept from a pan bring their samples with them if they had any.
+        // Tiles copied from the cache or the store of earlier runs leave their samples as they were:
+        std::atomic<uint32_t>* const tileSamples = zoomLevel.tileSamples.get();
+        const async_tiled::TilePrefill fetchCached = async_tiled::cachedTiles(tileCache, worldTiles.origin);
+        const uint64_t renderParams = async_tiled::renderParamsHash(MAX_ITERATIONS, zoomLevel.palette);
+        const async_tiled::TilePrefill fetchStored = async_tiled::storedTiles(tileStore, worldTiles.origin, renderParams);
+        const async_tiled::TilePrefill prefill = [fetchCached, fetchStored, tileSamples, tileGridDims, generation, panned, worldTiles, lastTiles, lastGeneration, &zoomLevel, &lastZoomLevel]
+            (const async_tiled::TileSpec& spec, async_tiled::Tile2D& tile) -> bool
+        {
+            std::atomic<uint32_t>& samples = tileSamples[tile.y * tileGridDims.w + tile.x];
+            const int64_t lastX = worldTiles.origin.x + tile.x - lastTiles.origin.x;
+            const int64_t lastY = worldTiles.origin.y + tile.y - lastTiles.origin.y;
+            if(panned && lastX >= 0 && lastY >= 0 && lastX < lastTiles.dims.w && lastY < lastTiles.dims.h)
+            {
+                const uint32_t lastSamples = lastZoomLevel.tileSamples[lastY * lastTiles.dims.w + lastX].load(std::memory_order_acquire);
+                if(lastSamples == 2 * lastGeneration || lastSamples == 2 * lastGeneration + 1)
+                {
+                    const async_tiled::Tile2D lastTile {uint16_t(lastX), uint16_t(lastY)};
+                    // Both levels store their tiles the same way up, so rows go across as they lie in memory:
+                    for(unsigned y = 0; y < spec.h; ++y)
+                    {
+                        std::memcpy(tile.pixels + y * spec.stride, lastZoomLevel.framebuffer.row(lastTile.y * spec.h + y) + lastTile.x * spec.w, spec.w * sizeof(TilePixel));
+                        if(lastSamples % 2 == 0)
+                        {
+                            std::memcpy(zoomLevel.iterations.countRow(spec, tile, y), lastZoomLevel.iterations.countRow(spec, lastTile, y), spec.w * sizeof(uint32_t));
+                        }
+                    }
+                    if(lastSamples % 2 == 1)
+                    {
+                        samples.store(2 * generation + 1, std::memory_order_relaxed);
+                    }
+                    return true;
+                }
+            }
+            if(!fetchCached(spec, tile) && !fetchStored(spec, tile))
+            {
+                return false;
+            }
+            samples.store(2 * generation + 1, std::memory_order_relaxed);
+            return true;
         };
-        zoomLevel.tileCompletions = async_tiled::mandelbrotAsyncTiled(
-                                                                      // The region we want to include: -2, 1, 1.5001f, -1.4999f,
-                                                                      zoomLevel.zoomRegion.centreX - (zoomLevel.zoomRegion.width * 0.5),
-                                                                      zoomLevel.zoomRegion.centreX + (zoomLevel.zoomRegion.width * 0.5),
-                                                                      zoomLevel.zoomRegion.centreY - (zoomLevel.zoomRegion.height * 0.5),
-                                                                      zoomLevel.zoomRegion.centreY + (zoomLevel.zoomRegion.height * 0.5),
-                                                                      64,
-                                                                      transaction,
-                                                                      newestTransaction,
-                                                                      {unsigned(trueSize.width / tileDims), unsigned(trueSize.height / tileDims)}, spec, tiles, framebuffer);
+        // Iterate in the cheapest type which can resolve the pixels at this zoom,
+        // copying tiles seen before out of the cache instead:
+        zoomLevel.tileCompletions = async_tiled::mandelbrotAsyncTiledAutoPrecision(
+                                                                      centreX, centreY, spanX, spanY,
+                                                                      MAX_ITERATIONS,
+                                                                      cancellation,
+                                                                      tileGridDims, spec, tiles, framebuffer,
+                                                                      zoomLevel.iterations, zoomLevel.palette,
+                                                                      nullptr, zoomLevel.schedule, prefill, seed);
         zoomLevel.tilesInFlight = unsigned (zoomLevel.tileCompletions.size());
 
-        // Wait for all the futures in launch order here on the background thread:
-        auto& future_tiles = zoomLevel.tileCompletions;
-        for(auto it = future_tiles.begin(), end = future_tiles.end(); it != end; ++it)
+        // Hand tiles to the GUI thread as they finish, waiting for them here on the
+        // background thread. Any others which finished while one was awaited go with it:
+        async_tiled::TileStream& finishedTiles = zoomLevel.tileCompletions;
+        std::vector<async_tiled::Tile2D*> batch;
+        batch.reserve(tileGridDims.w * tileGridDims.h);
+        std::vector<async_tiled::TileRun> runs;
+        auto tileOf = [](const async_tiled::Tile2D* tile) -> const async_tiled::Tile2D& { return *tile; };
+        while(async_tiled::Tile2D* const firstTile = finishedTiles.pop())
         {
-            std::future<async_tiled::Tile2D&>& futureTile = *it;
-            // If this transaction is old, wait for all pending tiles to abort themselves and exit:
-            if(newestTransaction != transaction)
+            // If this zoom has been superseded, wait for any running tiles to abort themselves and exit.
+            // The queued ones were dropped by the cancel:
+            if(cancellation->cancelled())
             {
-                for(;it != end; ++it)
-                {
-                    //cancelled.get();
-                    it->get();
-                }
+                cancellation->waitQuiesced();
                 zoomLevel.tilesInFlight = 0;
                 break;
             }
+            batch.assign(1, firstTile);
+            finishedTiles.drain(batch);
 
-            // Wait for the tile to finish here, off the GUI thread:
-            async_tiled::Tile2D& tile = futureTile.get();
-
-            // Modify the sprite on the GUI thread:
-            Director::getInstance()->getScheduler()->performFunctionInCocosThread([spec, &tile, &zoomLevel, transaction, &newestTransaction, &lastZoomLevel](){
-                if(newestTransaction == transaction)
+            // Keep the tiles for next time. Tiles of a cancelled launch may be unfinished, so those are not kept:
+            for(async_tiled::Tile2D* const tile : batch)
+            {
+                if(!cancellation->cancelled())
                 {
-                    std::vector<async_tiled::RGBA> tileBuffer;
-                    tileBuffer.resize(spec.w * spec.h);
-                    zoomLevel.tileGrid->setVisible(true);
-                    async_tiled::copyTileFlipped(spec, tile, &tileBuffer[0]);
-                    Sprite* tileSprite = zoomLevel.tileSprites[tile.y][tile.x];
-                    Texture2D* texture = tileSprite->getTexture();
-                    texture->updateWithData(&tileBuffer[0], 0, 0, spec.w, spec.h);
-                    tileSprite->setVisible(true);
-                    ++zoomLevel.tilesUpdated;
-                    // Hide the previous grid if this is the last tile:
-                    if(zoomLevel.tilesUpdated == zoomLevel.tiles.size()){
-                        lastZoomLevel.tileGrid->setVisible(false);
-                        auto& children = lastZoomLevel.tileGrid->getChildren();
-                        for(auto child : children){
-                            if(child){
-                                child->setVisible(false);
-                            }
-                        }
+                    const async_tiled::TileKey key {worldTiles.origin.level, worldTiles.origin.x + tile->x, worldTiles.origin.y + tile->y};
+                    tileCache.store(key, spec, *tile);
+                    tileStore.store(key, renderParams, spec, *tile);
+                    std::atomic<uint32_t>& samples = tileSamples[tile->y * tileGridDims.w + tile->x];
+                    if(samples.load(std::memory_order_relaxed) != 2 * generation + 1)
+                    {
+                        // Its samples are whole, so the next zoom in can use them:
+                        samples.store(2 * generation, std::memory_order_release);
                     }
                 }
-                else{
-                    std::cerr << "Skipped updating tile as transaction has changed from " << transaction << " to " << newestTransaction << std::endl;
+            }
+
+            // Merge the batch into rectangles of adjacent tiles and pack each one's rows together
+            // here, so the GUI thread uploads it with one call and copies nothing.
+            // Tiles with a texture each go up alone:
+            std::sort(batch.begin(), batch.end(), [](const async_tiled::Tile2D* a, const async_tiled::Tile2D* b) {
+                return a->y != b->y ? a->y < b->y : a->x < b->x;
+            });
+            async_tiled::coalesceTiles(batch.begin(), batch.end(), tileOf, tileGridDims.w, zoomLevel.tileAtlas ? uploadStaging.maxRun() : 1, runs);
+            for(const async_tiled::TileRun& run : runs)
+            {
+                async_tiled::StagingRing::Run staging;
+                while(!uploadStaging.tryAcquireRun(size_t(run.w) * run.h, staging))
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 }
-                assert(zoomLevel.tilesInFlight > 0);
-                if(zoomLevel.tilesInFlight > 0){
-                    --zoomLevel.tilesInFlight;
+                async_tiled::packTileRun(spec, run, [&batch, &run](const size_t i) -> const async_tiled::Tile2D& { return *batch[run.first + i]; },
+                                         uploadStaging.data(staging.slot));
+                while(!tileReady.tryPush({&zoomLevel, run.x, run.y, run.w, run.h, staging, cancellation}))
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 }
-            });
+            }
         }
         return true;
     });
@@ -234,20 +490,21 @@ void applyZoom(Camera& zoomCamera, const Region2D& zoomRegion)
 {
     zoomCamera.initOrthographic(zoomRegion.width, zoomRegion.height, -1024, 1024);
     zoomCamera.setPosition({
-        float(zoomRegion.centreX - zoomRegion.width / 2),
-        float(zoomRegion.centreY - zoomRegion.height / 2)
+        float(double(zoomRegion.centreX) - zoomRegion.width / 2),
+        float(double(zoomRegion.centreY) - zoomRegion.height / 2)
     });
 }
 
-void updateTilesForRegion(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const uint16_t transaction, std::atomic<uint16_t>& newestTransaction)
+void updateTilesForRegion(ZoomLevel& zoomLevel, ZoomLevel& lastZoomLevel, const std::shared_ptr<async_tiled::CancellationToken> cancellation, async_tiled::BoundedMpscQueue<TileUpload>& tileReady, async_tiled::StagingRing& uploadStaging, async_tiled::TileCache<TilePixel>& tileCache, async_tiled::TileStore<TilePixel>& tileStore)
 {
     const Size visibleSize = Director::getInstance()->getVisibleSize();
     const unsigned pixelScaling = Director::getInstance()->getContentScaleFactor();
     const Size trueSize = visibleSize * pixelScaling;
 
-    fitTileGridToRegion(visibleSize, pixelScaling, zoomLevel.tileSprites, TILE_DIMS << 16 | TILE_DIMS, zoomLevel.zoomRegion, false);
+    zoomLevel.worldTiles = placeWorldTiles(zoomLevel.zoomRegion, trueSize, TILE_DIMS, {zoomLevel.tileSprites.width(), zoomLevel.tileSprites.height()});
+    fitTileGridToRegion(visibleSize, pixelScaling, zoomLevel.tileSprites, TILE_DIMS << 16 | TILE_DIMS, zoomLevel.worldTiles, false);
 
-    generateTiles(zoomLevel, lastZoomLevel, transaction, newestTransaction, TILE_DIMS, trueSize);
+    generateTiles(zoomLevel, lastZoomLevel, cancellation, tileReady, uploadStaging, tileCache, tileStore, TILE_DIMS, trueSize);
 }
 
 void dumpTouch(std::ostream& out, const cocos2d::Touch* touch)
@@ -295,19 +552,28 @@ bool HelloWorld::init()
 
     // Init Zoom levels:
     // Interesting part in left,right, top, bottom: -2, 1, 1.5001f, -1.4999f
-    const double ratio = double(visibleSize.width) / visibleSize.height;
-    double height = 3.0;
-    double width = height * ratio;
-    if(width < 3.0)
-    {
-        width = 3.0;
-        height = width / ratio;
-    }
+    // Fit at least 3 units in each direction, with pixels a power of two in
+    // size so the tiles line up with the world tiles of the cache:
+    const double pixelSize = std::exp2(std::ceil(std::log2(std::fmax(3.0 / trueSize.width, 3.0 / trueSize.height))));
+    const double width = trueSize.width * pixelSize;
+    const double height = trueSize.height * pixelSize;
 
     zoomTransaction = 0;
 
+    // Views seen in earlier runs come back from the store without iterating:
+    if(!tileStore.open(FileUtils::getInstance()->getWritablePath() + "tiles.store", TILE_STORE_CAPACITY))
+    {
+        std::cerr << "Couldn't open the tile store, so finished tiles won't be kept between runs." << std::endl;
+    }
+
     zoomLevels[0].zoomRegion = Region2D{ (-2 + 1) * 0.5, 0.0, width, height, 0.0};
     const auto& zoomRegion = zoomLevels[0].zoomRegion;
+    const async_tiled::Dims2U spriteGridDims = tileSpriteGridDims(visibleSize, pixelScaling, (tileDims << 16u) + tileDims);
+    zoomLevels[0].worldTiles = placeWorldTiles(zoomRegion, trueSize, tileDims, spriteGridDims);
+    for(ZoomLevel& zoom : zoomLevels)
+    {
+        zoom.worldTiles = zoomLevels[0].worldTiles;
+    }
 
     tileLayer = Layer::create();
     addChild(tileLayer);
@@ -321,8 +587,8 @@ bool HelloWorld::init()
     //zoomCamera->setPosition({float(zoomRegion.centreX), float(zoomRegion.centreY)});
     // initOrthographic puts (0,0) at bottom left of screen so we need to porsition the camera to pop the world origin back in the centre of the screen:
     zoomCamera->setPosition({
-        float(zoomRegion.centreX - zoomRegion.width / 2),
-        float(zoomRegion.centreY - zoomRegion.height / 2)
+        float(double(zoomRegion.centreX) - zoomRegion.width / 2),
+        float(double(zoomRegion.centreY) - zoomRegion.height / 2)
     });
     zoomCamera->setCameraFlag(ZoomCameraFlag);
     //tileLayer->addChild(zoomCamera);
@@ -334,20 +600,23 @@ bool HelloWorld::init()
     //tileGrids->setAnchorPoint({0.5, 0.5});
     //tileLayer->addChild(tileGrids);
     auto gridBuild = [&](ZoomLevel& zoom) -> void {
-        Node* grid = buildTileGrid(visibleSize, pixelScaling, origin, zoom.tileSprites, (tileDims << 16u) + tileDims, zoomRegion);
+        Node* grid = buildTileGrid(visibleSize, pixelScaling, origin, zoom.tileSprites, (tileDims << 16u) + tileDims, zoom.worldTiles, zoom.tileAtlas);
         //grid->setAnchorPoint({0.5, 0.5});
         grid->setPosition(origin + Vec2{0, 0}); // y = -32 seems to work. Why?
         tileLayer->addChild(grid);
         zoom.tileGrid = grid;
         grid->setVisible(false); // We'll turn it on when we draw something into it.
     };
-    gridBuild(zoomLevels[0]);
-    gridBuild(zoomLevels[1]);
+    for(ZoomLevel& zoom : zoomLevels)
+    {
+        gridBuild(zoom);
+    }
 
     // Fill the tile sprites:
     auto& zoomLevel = zoomLevels[0];
-    zoomLevel.zoomTransaction = 0;
-    generateTiles(zoomLevel, zoomLevels[1], 0, zoomTransaction, tileDims, trueSize);
+    generateTiles(zoomLevel, zoomLevelOf(0u - 1u), newZoomCancellation(), tileReady, uploadStaging, tileCache, tileStore, tileDims, trueSize);
+    // Finished tiles are uploaded once per frame:
+    scheduleUpdate();
 
     tileLayer->setCameraMask(static_cast<unsigned short>(ZoomCameraFlag), true);
 
@@ -418,12 +687,16 @@ bool HelloWorld::init()
     //  Create a "one by one" touch event listener
     // (processes one touch at a time)
     listener1 = EventListenerTouchOneByOne::create();
-    listener1->setSwallowTouches(true);
+    // Left for the pinch listener to see too:
+    listener1->setSwallowTouches(false);
 
-    // Currently do nothing but debug log the event on touch begin:
-    listener1->onTouchBegan = [](Touch* touch, Event* event){
+    // Pull the tiles still to be generated under the finger to the front of the queue:
+    listener1->onTouchBegan = [&](Touch* touch, Event* event){
         std::cerr << "onTouchBegan" << std::endl;
         dumpTouch(std::cerr, touch);
+        const Vec2 screenPoint = (touch->getLocation() - Director::getInstance()->getVisibleOrigin()) * Director::getInstance()->getContentScaleFactor();
+        ZoomLevel& zoomLevel = zoomLevelOf(zoomTransaction);
+        zoomLevel.schedule->setFocus({zoomLevel.worldTiles.viewOffset.x + screenPoint.x, zoomLevel.worldTiles.viewOffset.y + screenPoint.y});
         return true; // if you are consuming it
     };
 
@@ -434,12 +707,13 @@ bool HelloWorld::init()
         //std::cerr << std::endl;
 
         const auto screenDelta = touch->getDelta();
-        if(screenDelta.x != 0.0f && screenDelta.y != 0.0f)
+        // A pinch moves the view itself:
+        if(screenDelta.x != 0.0f && screenDelta.y != 0.0f && touchPoints.size() < 2)
         {
             // Update the camera position without firing off any background tile regeneration
             // until the touch is ended later:
             unsigned transaction = zoomTransaction;
-            auto& zoomLevel = zoomLevels[transaction&1u];
+            auto& zoomLevel = zoomLevelOf(transaction);
             auto& zoomRegion = zoomLevel.zoomRegion;
 
             const auto scaleX = zoomRegion.width / visibleSize.width;
@@ -458,10 +732,15 @@ bool HelloWorld::init()
     listener1->onTouchEnded = [&](Touch* touch, Event* event){
         std::cerr << "onTouchEnded" << std::endl;
         dumpTouch(std::cerr, touch);
+        // The level for a pinch is started once it rests, which takes in any pan with it:
+        if(zoomGesture)
+        {
+            return true;
+        }
 
         unsigned transaction = ++zoomTransaction;
-        auto& zoomLevel = zoomLevels[transaction&1u];
-        auto& lastZoomLevel = zoomLevels[(transaction-1u)&1u];
+        auto& zoomLevel = zoomLevelOf(transaction);
+        auto& lastZoomLevel = zoomLevelOf(transaction - 1u);
         auto& zoomRegion = zoomLevel.zoomRegion;
         zoomRegion = lastZoomLevel.zoomRegion;
 
@@ -472,14 +751,11 @@ bool HelloWorld::init()
 
         zoomRegion.centreX -= cameraDelta.x;
         zoomRegion.centreY -= cameraDelta.y;
+        const Vec2 snap = snapToPixels(zoomRegion, visibleSize * Director::getInstance()->getContentScaleFactor());
 
-        zoomCamera->setPosition(zoomCamera->getPosition() - cameraDelta);
-
-        updateTilesForRegion(zoomLevel, lastZoomLevel, transaction, this->zoomTransaction);
+        zoomCamera->setPosition(zoomCamera->getPosition() - cameraDelta + snap);
 
-        // Reorder tile grids so new tiles cover old ones:
-        zoomLevels[transaction-1u&1u].tileGrid->setLocalZOrder(-1);
-        zoomLevel.tileGrid->setLocalZOrder(1);
+        updateTilesForRegion(zoomLevel, lastZoomLevel, newZoomCancellation(), tileReady, uploadStaging, tileCache, tileStore);
 
         return true;
     };
@@ -487,18 +763,203 @@ bool HelloWorld::init()
     // Add listener
     _eventDispatcher->addEventListenerWithSceneGraphPriority(listener1, this);
 
+    // Two fingers zoom about the point between them.
     // Need to turn on multitouch in Xcode flag somewhere to use this: (Google the procedure)
-    // auto listener2 = EventListenerTouchAllAtOnce::create();
-    // listener2->onTouchesBegan = [] (const std::vector<Touch*>& touches, Event* event){
-    //    std::cerr << "onTouchesBegan " << touches.size() << ", " << unsigned(event->getType()) << std::endl;
-    //    return true;
-    //};
-    //_eventDispatcher->addEventListenerWithSceneGraphPriority(listener2, this);
+    auto pinchListener = EventListenerTouchAllAtOnce::create();
+    pinchListener->onTouchesBegan = [&](const std::vector<Touch*>& touches, Event* event){
+        for(const Touch* touch : touches)
+        {
+            touchPoints[touch->getID()] = touch->getLocation();
+        }
+    };
+    pinchListener->onTouchesMoved = [&](const std::vector<Touch*>& touches, Event* event){
+        // Only the first two fingers down pinch:
+        const auto first = touchPoints.begin();
+        const auto second = touchPoints.size() < 2 ? touchPoints.end() : std::next(first);
+        const float before = second == touchPoints.end() ? 0.0f : first->second.distance(second->second);
+        for(const Touch* touch : touches)
+        {
+            const auto point = touchPoints.find(touch->getID());
+            if(point != touchPoints.end())
+            {
+                point->second = touch->getLocation();
+            }
+        }
+        if(before > 0.0f)
+        {
+            const float after = first->second.distance(second->second);
+            if(after > 0.0f)
+            {
+                zoomBy(after / before, (first->second + second->second) * 0.5f);
+            }
+        }
+    };
+    pinchListener->onTouchesEnded = [&](const std::vector<Touch*>& touches, Event* event){
+        for(const Touch* touch : touches)
+        {
+            touchPoints.erase(touch->getID());
+        }
+    };
+    pinchListener->onTouchesCancelled = pinchListener->onTouchesEnded;
+    _eventDispatcher->addEventListenerWithSceneGraphPriority(pinchListener, this);
+
+    // The scroll wheel zooms about the cursor, scrolling up going in:
+    auto scrollListener = EventListenerMouse::create();
+    scrollListener->onMouseScroll = [&](EventMouse* event){
+        zoomBy(std::pow(SCROLL_ZOOM_PER_STEP, -event->getScrollY()), event->getLocation());
+    };
+    _eventDispatcher->addEventListenerWithSceneGraphPriority(scrollListener, this);
 
     return true;
 }
 
 
+void HelloWorld::update(float delta)
+{
+    // Start on the exact level once a pinch or scroll has rested:
+    if(zoomGesture && touchPoints.size() < 2)
+    {
+        zoomGestureIdle += delta;
+        if(zoomGestureIdle >= ZOOM_SETTLE_SECONDS)
+        {
+            settleZoom();
+        }
+    }
+    if(settleScale != 1.0f)
+    {
+        settleScale = 1.0f + (settleScale - 1.0f) * ZOOM_SETTLE_EASING;
+        if(std::abs(settleScale - 1.0f) < 1.0f / 1024)
+        {
+            settleScale = 1.0f;
+        }
+        Region2D shown = zoomLevelOf(zoomTransaction).zoomRegion;
+        shown.width *= settleScale;
+        shown.height *= settleScale;
+        applyZoom(*zoomCamera, shown);
+    }
+
+    // Stop once either budget is spent and leave the rest for the next frame, so a
+    // burst of finished tiles doesn't stall the frame:
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(uploadBudgetMillis));
+    uploadStats = UploadStats();
+    TileUpload upload;
+    while(uploadStats.bytes < uploadBudgetBytes && std::chrono::steady_clock::now() < deadline && tileReady.tryPop(upload))
+    {
+        uploadTiles(upload, uploadStaging, uploadStats);
+    }
+    arrangeLevels();
+}
+
+void HelloWorld::zoomBy(const double factor, const Vec2 location)
+{
+    ZoomLevel& zoomLevel = zoomLevelOf(zoomTransaction);
+    Region2D& zoomRegion = zoomLevel.zoomRegion;
+    // Carry on from the scale on screen if a settle is still being eased onto:
+    zoomRegion.width *= settleScale;
+    zoomRegion.height *= settleScale;
+    settleScale = 1.0f;
+
+    // Keep the point of the world under the location where it is:
+    const Vec2 fromCentre = location - Director::getInstance()->getVisibleOrigin() - Vec2(visibleSize.width * 0.5f, visibleSize.height * 0.5f);
+    const double worldX = fromCentre.x * zoomRegion.width / visibleSize.width;
+    const double worldY = fromCentre.y * zoomRegion.height / visibleSize.height;
+    zoomRegion.centreX += async_tiled::Coordinate(worldX * (1.0 - 1.0 / factor));
+    zoomRegion.centreY += async_tiled::Coordinate(worldY * (1.0 - 1.0 / factor));
+    zoomRegion.width /= factor;
+    zoomRegion.height /= factor;
+    applyZoom(*zoomCamera, zoomRegion);
+    zoomGesture = true;
+    zoomGestureIdle = 0.0f;
+
+    // Pull the tiles still to come under the location forward, and stop iterating
+    // the level altogether once the gesture has left its scale behind:
+    const WorldTileGrid& worldTiles = zoomLevel.worldTiles;
+    const int log2TileSize = -worldTiles.origin.level;
+    const int log2PixelSize = log2TileSize - int(std::lround(std::log2(double(TILE_DIMS))));
+    const async_tiled::Coordinate cornerX = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(worldTiles.origin.x, log2TileSize);
+    const async_tiled::Coordinate cornerY = async_tiled::timesPowerOfTwo<async_tiled::COORDINATE_LIMBS>(worldTiles.origin.y, log2TileSize);
+    const async_tiled::Coordinate focusX = zoomRegion.centreX + async_tiled::Coordinate(worldX / factor);
+    const async_tiled::Coordinate focusY = zoomRegion.centreY + async_tiled::Coordinate(worldY / factor);
+    zoomLevel.schedule->setFocus({float(std::ldexp(double(focusX - cornerX), -log2PixelSize)), float(std::ldexp(double(focusY - cornerY), -log2PixelSize))});
+    const double trueWidth = visibleSize.width * Director::getInstance()->getContentScaleFactor();
+    if(std::abs(std::log2(zoomRegion.width / trueWidth) - log2PixelSize) >= 1.0 && zoomLevel.launchCancellation)
+    {
+        zoomLevel.launchCancellation->cancel();
+    }
+}
+
+void HelloWorld::settleZoom()
+{
+    zoomGesture = false;
+    const unsigned transaction = ++zoomTransaction;
+    auto& zoomLevel = zoomLevelOf(transaction);
+    auto& lastZoomLevel = zoomLevelOf(transaction - 1u);
+    auto& zoomRegion = zoomLevel.zoomRegion;
+    zoomRegion = lastZoomLevel.zoomRegion;
+
+    // Tiles need pixels a power of two in size, so take the nearest and ease the camera onto it:
+    const Size trueSize = visibleSize * Director::getInstance()->getContentScaleFactor();
+    const double pixelSize = std::exp2(std::round(std::log2(zoomRegion.width / trueSize.width)));
+    settleScale = float(zoomRegion.width / (trueSize.width * pixelSize));
+    zoomRegion.width = trueSize.width * pixelSize;
+    zoomRegion.height = trueSize.height * pixelSize;
+    snapToPixels(zoomRegion, trueSize);
+    Region2D shown = zoomRegion;
+    shown.width *= settleScale;
+    shown.height *= settleScale;
+    applyZoom(*zoomCamera, shown);
+
+    updateTilesForRegion(zoomLevel, lastZoomLevel, newZoomCancellation(), tileReady, uploadStaging, tileCache, tileStore);
+}
+
+void HelloWorld::arrangeLevels()
+{
+    const unsigned transaction = zoomTransaction;
+    const ZoomLevel& current = zoomLevelOf(transaction);
+    const double trueWidth = visibleSize.width * Director::getInstance()->getContentScaleFactor();
+    const double viewLog2TileSize = std::log2(current.zoomRegion.width * settleScale / trueWidth * TILE_DIMS);
+    const bool currentDone = !zoomGesture && current.tilesUpdated == current.worldTiles.dims.w * current.worldTiles.dims.h;
+
+    // Levels by age, newest first, then stably by how far their scale is from the view's:
+    unsigned ages[ZOOM_LEVELS];
+    std::iota(std::begin(ages), std::end(ages), 0u);
+    std::stable_sort(std::begin(ages), std::end(ages), [&](const unsigned a, const unsigned b) {
+        return std::abs(-zoomLevelOf(transaction - a).worldTiles.origin.level - viewLog2TileSize) <
+               std::abs(-zoomLevelOf(transaction - b).worldTiles.origin.level - viewLog2TileSize);
+    });
+    // The nearest goes on top, with the others showing through its gaps.
+    // Once the current level is whole nothing shows through, so the rest aren't drawn:
+    for(unsigned rank = 0; rank < ZOOM_LEVELS; ++rank)
+    {
+        ZoomLevel& level = zoomLevelOf(transaction - ages[rank]);
+        level.tileGrid->setVisible(level.tilesUpdated > 0 && (ages[rank] == 0 || !currentDone));
+        level.tileGrid->setLocalZOrder(-int(rank));
+    }
+}
+
+void HelloWorld::setUploadBudget(const size_t bytes, const double millis)
+{
+    uploadBudgetBytes = bytes;
+    uploadBudgetMillis = millis;
+}
+
+void HelloWorld::setTileCacheBudget(const size_t bytes)
+{
+    tileCache.setBudget(bytes);
+}
+
+std::shared_ptr<async_tiled::CancellationToken> HelloWorld::newZoomCancellation()
+{
+    // Drops the tiles of the last zoom still queued and stops the running ones:
+    if(zoomCancellation)
+    {
+        zoomCancellation->cancel();
+    }
+    zoomCancellation = std::make_shared<async_tiled::CancellationToken>();
+    return zoomCancellation;
+}
+
 void HelloWorld::menuCloseCallback(Ref* pSender)
 {
     //Close the cocos2d-x game scene and quit the application
@@ -519,44 +980,16 @@ void HelloWorld::menuZoomInCallback(cocos2d::Ref* pSender)
 {
     std::cerr << "Zoom In" << std::endl;
 
-    unsigned transaction = ++zoomTransaction;
-    auto& zoomLevel = zoomLevels[transaction&1u];
-    auto& lastZoomLevel = zoomLevels[(transaction-1u)&1u];
-    auto& zoomRegion = zoomLevel.zoomRegion;
-    zoomRegion = lastZoomLevel.zoomRegion;
-
-    zoomRegion.width *= 0.5;
-    zoomRegion.height *= 0.5;
-    applyZoom(*zoomCamera, zoomRegion);
-
-    updateTilesForRegion(zoomLevel, lastZoomLevel, transaction, this->zoomTransaction);
-
-    // Reorder tile grids so new tiles cover old ones:
-    zoomLevels[transaction-1u&1u].tileGrid->setLocalZOrder(-1);
-    zoomLevel.tileGrid->setLocalZOrder(1);
-
-    ///@TODO : On completion, make all tiles of old grid invisible.
-
+    // A step of the gesture zoom about the centre, settled straight away:
+    zoomBy(2.0, Director::getInstance()->getVisibleOrigin() + Vec2(visibleSize.width * 0.5f, visibleSize.height * 0.5f));
+    settleZoom();
 }
 void HelloWorld::menuZoomOutCallback(cocos2d::Ref* pSender)
 {
     std::cerr << "Zoom Out" << std::endl;
 
-    unsigned transaction = ++zoomTransaction;
-    auto& zoomLevel = zoomLevels[transaction&1u];
-    auto& lastZoomLevel = zoomLevels[(transaction-1u)&1u];
-    auto& zoomRegion = zoomLevel.zoomRegion;
-    zoomRegion = lastZoomLevel.zoomRegion;
-
-    zoomRegion.width *= 2;
-    zoomRegion.height *= 2;
-    applyZoom(*zoomCamera, zoomRegion);
-
-    updateTilesForRegion(zoomLevel, lastZoomLevel, transaction, this->zoomTransaction);
-
-    // Reorder tile grids so new tiles cover old ones:
-    zoomLevels[transaction-1u&1u].tileGrid->setLocalZOrder(-1);
-    zoomLevel.tileGrid->setLocalZOrder(1);
+    zoomBy(0.5, Director::getInstance()->getVisibleOrigin() + Vec2(visibleSize.width * 0.5f, visibleSize.height * 0.5f));
+    settleZoom();
 }
 
 }
@@ -3,13 +3,40 @@
 
 #include "cocos2d.h"
 #include "async_tiled.h"
+#include "fixed_point.h"
+#include "palette.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+#include "staging_ring.h"
 //#include "fractals.h"
 #include <atomic>
+#include <map>
 
 namespace async_tiled_gui {
 using namespace async_tiled;
 
 constexpr unsigned TILE_DIMS = 32;
+constexpr unsigned MAX_ITERATIONS = 64;
+/// Draw each level's tiles from one texture as one batch, rather than a texture and draw per tile.
+/// Levels too big for a texture fall back to a texture per tile anyway.
+constexpr bool USE_TILE_ATLAS = true;
+/// What tiles are rendered, kept and uploaded as. The palette only makes greys, so a byte of grey is enough.
+using TilePixel = I8;
+/// Default for how much memory finished tiles can be kept in to revisit views.
+constexpr size_t TILE_CACHE_BUDGET = 64u << 20u;
+/// Size of the file finished tiles are kept in between runs.
+constexpr size_t TILE_STORE_CAPACITY = 256u << 20u;
+/// Default for how many bytes of tiles are uploaded each frame, which the staging ring is sized to.
+constexpr size_t UPLOAD_BUDGET_BYTES = 4u << 20u;
+/// How many zoom levels are kept, the newest being computed and the rest drawn scaled under it while zooming.
+constexpr unsigned ZOOM_LEVELS = 4;
+static_assert((ZOOM_LEVELS & (ZOOM_LEVELS - 1)) == 0, "The zoom count wraps, so the ring must divide it.");
+/// How much one step of the scroll wheel zooms by.
+constexpr double SCROLL_ZOOM_PER_STEP = 1.25;
+/// How long a pinch or scroll must rest before the level for its scale is computed.
+constexpr float ZOOM_SETTLE_SECONDS = 0.2f;
+/// What is left each frame of the camera's easing onto a settled level's scale.
+constexpr float ZOOM_SETTLE_EASING = 0.7f;
 constexpr cocos2d::CameraFlag ZoomCameraFlag = cocos2d::CameraFlag::USER1;
 constexpr cocos2d::CameraFlag UICameraFlag = cocos2d::CameraFlag::USER2;
 
@@ -73,18 +100,33 @@ struct MinMax2D
 
 struct Region2D
 {
-    double centreX;
-    double centreY;
+    /// Fixed-point so panning far into a deep zoom doesn't round the centre off.
+    async_tiled::Coordinate centreX;
+    async_tiled::Coordinate centreY;
     double width;
     double height;
     double rotation;
 };
 
+/**
+ * Where a zoom level's grid of tiles sits in the quadtree of world tiles.
+ * Pixels are kept a power of two in size so tile edges fall on the world grid
+ * at every zoom, and panning or zooming back to a view finds the same tiles.
+ */
+struct WorldTileGrid
+{
+    /// The world tile under the bottom left tile of the grid.
+    TileKey origin;
+    Dims2U dims;
+    /// Where the bottom left of the view falls in the grid's framebuffer, in pixels.
+    Point2F viewOffset;
+};
+
 /**
  * All the state related to a particular zoom level.
- * It is expected to keep to of these: one for the previous zoom level, which
- * will continue to be drawn with scaling, and one for the level currently being
- * generated.
+ * A ring of ZOOM_LEVELS of these is kept: the level currently being generated
+ * and the ones before it, which continue to be drawn with scaling while it
+ * fills in or while a gesture zooms away from it.
  */
 class ZoomLevel
 {
@@ -99,14 +141,19 @@ public:
     std::mutex launcherLock;
 
     Region2D zoomRegion; // W: GUI Thread, R: Tile tasks
-    Framebuffer framebuffer; // W: tile tasks, R: Gui Thread
+    WorldTileGrid worldTiles; // W: GUI Thread, R: GUI Thread
+    PaddedFramebuffer<TilePixel> framebuffer; // W: tile tasks, R: Gui Thread
+    /// The samples behind framebuffer, kept so it can be recoloured without iterating.
+    IterationBuffer iterations; // W: tile tasks, R: tile tasks
+    PaletteLut palette {greyPalette(MAX_ITERATIONS), MAX_ITERATIONS};
+    /// Orders the tiles of a launch by distance from a focus in framebuffer pixels.
+    std::shared_ptr<TileSchedule> schedule = std::make_shared<TileSchedule>(); // W: GUI Thread, R: Tile tasks, Issuer/Waiter
     std::vector <Tile2D> tiles;
-    std::vector <std::future<Tile2D &>> tileCompletions;
+    TileStream tileCompletions; // W: Issuer/Waiter, R: Issuer/Waiter
     cocos2d::Node* tileGrid; // W: GUI Thread, R: GUI Thread
+    /// The texture every tile sprite is a rectangle of, or null if each has its own.
+    cocos2d::Texture2D* tileAtlas = nullptr; // W: GUI Thread, R: GUI Thread, Issuer/Waiter
     Array2D<cocos2d::Sprite*> tileSprites; // W: GUI Thread, R: GUI Thread
-    /// Zooms orginate on the GUI thread with a transaction ID. The issuer/waiter
-    /// task and the tile tasks monitor this to know when to abort.
-    std::atomic<uint16_t> zoomTransaction; // W: GUI Thread, Issuer/Waiter, R: Tile tasks
     /// Set when a zoom is begun, subsequent launches using this same struct
     /// wait for it to hit zero before beginning to avoid accessing framebuffer etc.
     /// shared data from multiple asynctasks concurrently.
@@ -114,6 +161,41 @@ public:
     /// is used to stop them fighting over shared data.
     std::atomic<uint32_t> tilesInFlight;
     uint32_t tilesUpdated = 0;
+    /// Counts the launches into this level, starting from one.
+    uint32_t launchGeneration = 0; // W: GUI Thread, R: GUI Thread
+    /// Per tile, twice the generation of the launch whose samples are in iterations,
+    /// plus one if that launch copied the tile's pixels from the cache instead.
+    std::unique_ptr<std::atomic<uint32_t>[]> tileSamples; // W: Tile tasks, Issuer/Waiter, R: Tile tasks
+    /// The last launch into this level, which may be seeded from the level before's samples.
+    std::shared_ptr<CancellationToken> launchCancellation; // W: GUI Thread, R: GUI Thread
+    /// The last launch which read this level as the one before it. Waited for before this level is overwritten.
+    std::shared_ptr<CancellationToken> readerCancellation; // W: GUI Thread, R: GUI Thread
+};
+
+/**
+ * A rectangle of finished tiles waiting for the GUI thread to upload them to
+ * their level's atlas with one call, or a single tile for its own sprite.
+ */
+struct TileUpload
+{
+    ZoomLevel* zoomLevel;
+    /// Bottom left tile and size, in tiles.
+    uint16_t x, y, w, h;
+    /// Where in the staging ring the rectangle's pixels wait, packed for uploading.
+    StagingRing::Run staging;
+    std::shared_ptr<CancellationToken> cancellation;
+};
+
+/// How many rectangles of finished tiles can wait for upload at once. More than fill a screen.
+constexpr size_t TILE_READY_CAPACITY = 4096;
+
+/** What a frame's tile uploads cost. */
+struct UploadStats
+{
+    unsigned tiles = 0;
+    /// Texture updates issued. Tiles adjacent in an atlas share one.
+    unsigned calls = 0;
+    size_t bytes = 0;
 };
 
 class HelloWorld : public cocos2d::Scene
@@ -127,17 +209,69 @@ public:
     void menuCloseCallback(cocos2d::Ref* pSender);
     void menuZoomInCallback(cocos2d::Ref* pSender);
     void menuZoomOutCallback(cocos2d::Ref* pSender);
+
+    /**
+     * Uploads the tiles which have finished since the last frame, within the budget.
+     * The waiters have already merged ones adjacent in a level's atlas into a rectangle each.
+     * What they cost is left in lastUploadStats().
+     */
+    void update(float delta) override;
+    /** What the last frame's uploads cost. */
+    const UploadStats& lastUploadStats() const { return uploadStats; }
+    /**
+     * Limit the tile uploads done each frame, whichever runs out first.
+     * Both are checked between rectangles, so a frame can go over by one.
+     * No more than UPLOAD_BUDGET_BYTES of tiles can be staged at once, however large the budget.
+     */
+    void setUploadBudget(size_t bytes, double millis);
+    /** Limit the memory the cache of finished tiles can take. */
+    void setTileCacheBudget(size_t bytes);
     
     // implement the "static create()" method manually
     CREATE_FUNC(HelloWorld);
 private:
     cocos2d::Camera* zoomCamera;
     cocos2d::Layer* tileLayer;
-    ZoomLevel zoomLevels[2];
-    std::atomic<uint16_t> zoomTransaction; // monotonic counter of async tile generation jobs. By the time it wraps the last duplicate will have cleared.
+    ZoomLevel zoomLevels[ZOOM_LEVELS];
+    std::atomic<uint16_t> zoomTransaction; // Counts zooms. Modulo ZOOM_LEVELS, it picks which of zoomLevels is being generated.
+    ZoomLevel& zoomLevelOf(const unsigned transaction) { return zoomLevels[transaction % ZOOM_LEVELS]; }
+    /**
+     * Scale the view about a point on screen, drawing the levels already made
+     * until the gesture rests.
+     * @param factor Above one zooms in.
+     * @param location In the same coordinates as touch locations.
+     */
+    void zoomBy(double factor, cocos2d::Vec2 location);
+    /// Start computing the level of power of two pixel size nearest the view.
+    void settleZoom();
+    /// Draw the levels nearest the view's scale on top, and only the current one once it is done.
+    void arrangeLevels();
+    /// A pinch or scroll has changed the scale since the last level was started.
+    bool zoomGesture = false; // W: GUI Thread, R: GUI Thread
+    float zoomGestureIdle = 0.0f; // W: GUI Thread, R: GUI Thread
+    /// How much wider than its level the camera still shows, easing to one after a settle.
+    float settleScale = 1.0f; // W: GUI Thread, R: GUI Thread
+    /// Where each finger down is, by touch ID, for pinches.
+    std::map<int, cocos2d::Vec2> touchPoints; // W: GUI Thread, R: GUI Thread
+    /// Zooms originate on the GUI thread with one of these. The issuer/waiter
+    /// task and the tile tasks watch it to know when to abort.
+    std::shared_ptr<CancellationToken> zoomCancellation; // W: GUI Thread
+    /// Cancel the zoom in progress, if any, and start a new one.
+    std::shared_ptr<CancellationToken> newZoomCancellation();
     uint8_t lastZoom = 0; // Index into zoomLevels
     cocos2d::Size visibleSize;
     cocos2d::EventListenerTouchOneByOne* listener1;
+    /// Filled by the waiter tasks, drained by update() on the GUI thread.
+    BoundedMpscQueue<TileUpload> tileReady {TILE_READY_CAPACITY};
+    /// Pixels of the tiles in tileReady. A frame's budget of tiles.
+    StagingRing uploadStaging {TILE_DIMS * TILE_DIMS * sizeof(TilePixel), UPLOAD_BUDGET_BYTES / (TILE_DIMS * TILE_DIMS * sizeof(TilePixel))}; // W: Issuer/Waiter, R: GUI Thread
+    size_t uploadBudgetBytes = UPLOAD_BUDGET_BYTES;
+    double uploadBudgetMillis = 4.0;
+    UploadStats uploadStats; // W: GUI Thread, R: GUI Thread
+    /// Finished tiles of every level in the ring, looked up before iterating a tile.
+    TileCache<TilePixel> tileCache {TILE_CACHE_BUDGET}; // W: Issuer/Waiter, R: Tile tasks
+    /// Finished tiles of earlier runs, looked up after the cache. Opened by init().
+    TileStore<TilePixel> tileStore; // W: Issuer/Waiter, R: Tile tasks
 
 };
 
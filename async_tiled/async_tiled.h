@@ -9,15 +9,37 @@
 #include <vector>
 #include <type_traits>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include "cacheline.h"
+#include "work_stealing_pool.h"
+#include "mpsc_queue.h"
+#include "tile_allocator.h"
 
 namespace async_tiled
 {
 
 enum class TileFormat
 {
-    RGBA8888 = 1
+    RGBA8888 = 1,
+    /// A byte of grey.
+    I8 = 2,
+    /// 16 bit colour.
+    RGB565 = 3,
+    /// Iteration counts rather than colours, for palettes applied when drawing.
+    U16 = 4
 };
 
+inline constexpr unsigned bytesPerPixel(const TileFormat format)
+{
+    return format == TileFormat::RGBA8888 ? 4u : format == TileFormat::I8 ? 1u : 2u;
+}
+
 /** @brief A byte-per-component pixel. */
 struct RGBA
 {
@@ -31,7 +53,49 @@ struct RGBA
     constexpr bool operator==(const RGBA& rhs) const { return r == rhs.r && g == rhs.g && b == rhs.b && a == rhs.a; }
 };
 
-using Framebuffer = std::vector<RGBA>;
+/** @brief A grey level, a quarter the size of RGBA for palettes which only make greys. */
+struct I8
+{
+    I8() {}
+    explicit I8(uint8_t i) : i(i) {}
+    /** The luma of a colour, exact for greys. */
+    explicit I8(const RGBA c) : i(uint8_t((c.r * 77u + c.g * 150u + c.b * 29u) >> 8u)) {}
+    static constexpr TileFormat format = TileFormat::I8;
+    uint8_t i;
+    constexpr bool operator==(const I8& rhs) const { return i == rhs.i; }
+};
+
+/** @brief A 16 bit colour, 5 bits of red in the top bits, then 6 of green and 5 of blue. */
+struct RGB565
+{
+    RGB565() {}
+    explicit RGB565(const RGBA c) : bits(uint16_t((c.r >> 3u) << 11u | (c.g >> 2u) << 5u | c.b >> 3u)) {}
+    static constexpr TileFormat format = TileFormat::RGB565;
+    uint16_t bits;
+    constexpr bool operator==(const RGB565& rhs) const { return bits == rhs.bits; }
+};
+
+/** @brief An iteration count, saturating at 65535. */
+struct U16
+{
+    U16() {}
+    explicit U16(uint16_t count) : count(count) {}
+    static constexpr TileFormat format = TileFormat::U16;
+    uint16_t count;
+    constexpr bool operator==(const U16& rhs) const { return count == rhs.count; }
+};
+
+/**
+ * How the rows of a tile lie in its block of the framebuffer. Tiles are always
+ * addressed by image row, row 0 first, whichever way up they are stored.
+ */
+enum class RowOrder
+{
+    /// Row 0 first, as images are.
+    TopDown,
+    /// Row 0 last, as texture uploads take them when row 0 is to be drawn at the bottom.
+    BottomUp
+};
 
 struct Dims2U
 {
@@ -45,17 +109,21 @@ struct Point2U
     unsigned y;
 };
 
+struct Point2F
+{
+    float x;
+    float y;
+};
+
 /**
  * A bundle of data related to a related group of tiles (like all the tiles in a
  * framebuffer).
  */
 struct TileSpec {
-    TileSpec(const TileFormat pixelFormat, const uint16_t w, const uint16_t h, const unsigned stride) :
-        pixelFormat(pixelFormat), w(w), h(h), stride(stride)
+    TileSpec(const TileFormat pixelFormat, const uint16_t w, const uint16_t h, const unsigned stride, const RowOrder rowOrder = RowOrder::TopDown) :
+        pixelFormat(pixelFormat), w(w), h(h), stride(stride), rowOrder(rowOrder)
     {}
-    /** Currently only one format is in use. */
-    /// @note We could avoid specifying the format here and let the functions
-    /// processing tiles define the data stored in them implicitly.
+    /** The pixel type the tile pixels are, which matches the framebuffer's. */
     const TileFormat pixelFormat = TileFormat::RGBA8888;
     /** Width of tile. */
     const uint16_t w;
@@ -63,8 +131,110 @@ struct TileSpec {
     const uint16_t h;
     /** The distance in bytes between scanlines of the tile in a pixel buffer. */
     const unsigned stride;
+    /** Which way up the rows of each tile are stored. */
+    const RowOrder rowOrder = RowOrder::TopDown;
 };
 
+/**
+ * Round up a number to a multiple of the length of a cacheline.
+ * @param i The memory address or size to round up.
+ * @param cachelineLength The length of cachelines of interest on the platform.
+ * @return The rounded-up value.
+ */
+inline constexpr unsigned RoundUpToCacheline(unsigned i, unsigned cachelineLength)
+{
+    return (i / cachelineLength + (i % cachelineLength > 0)) * cachelineLength;
+}
+
+/**
+ * A 2D image whose base and rows start on cachelines. Rows are padded out to a
+ * whole number of cachelines, so tiles a multiple of a cacheline wide get every
+ * row to themselves and threads writing neighbouring tiles never share a line.
+ * Pixels are addressed by row rather than by index as the padding is not part
+ * of the image.
+ */
+template<typename PixelType>
+class PaddedFramebuffer
+{
+public:
+    PaddedFramebuffer() : dims_{0, 0} {}
+    explicit PaddedFramebuffer(const Dims2U dims) : dims_{0, 0}
+    {
+        resize(dims);
+    }
+    PaddedFramebuffer(const PaddedFramebuffer& rhs) : PaddedFramebuffer(rhs.dims_)
+    {
+        if(bytes() > 0)
+        {
+            std::memcpy(base_, rhs.base_, bytes());
+        }
+    }
+    /** Takes rhs's pixels, leaving it empty. */
+    PaddedFramebuffer(PaddedFramebuffer&& rhs) : dims_{0, 0}
+    {
+        std::swap(dims_, rhs.dims_);
+        std::swap(stride_, rhs.stride_);
+        std::swap(storage_, rhs.storage_);
+        std::swap(base_, rhs.base_);
+    }
+    PaddedFramebuffer& operator = (PaddedFramebuffer rhs)
+    {
+        std::swap(dims_, rhs.dims_);
+        std::swap(stride_, rhs.stride_);
+        std::swap(storage_, rhs.storage_);
+        std::swap(base_, rhs.base_);
+        return *this;
+    }
+
+    /**
+     * Reallocate for new dimensions if they differ from the current ones.
+     * The pixels are left undefined when it does.
+     */
+    void resize(const Dims2U dims)
+    {
+        if(dims.w == dims_.w && dims.h == dims_.h)
+        {
+            return;
+        }
+        dims_ = dims;
+        stride_ = RoundUpToCacheline(dims.w * sizeof(PixelType), CACHELINE_LENGTH);
+        storage_.reset(new uint8_t[bytes() + CACHELINE_LENGTH]);
+        base_ = storage_.get() + (CACHELINE_LENGTH - reinterpret_cast<uintptr_t>(storage_.get()) % CACHELINE_LENGTH) % CACHELINE_LENGTH;
+    }
+
+    Dims2U dims() const { return dims_; }
+    unsigned width() const { return dims_.w; }
+    unsigned height() const { return dims_.h; }
+    /** The distance in bytes between the starts of rows. */
+    unsigned stride() const { return stride_; }
+    /** Size in bytes including the padding at the ends of rows. */
+    size_t bytes() const { return size_t(stride_) * dims_.h; }
+
+    uint8_t* data() { return base_; }
+    const uint8_t* data() const { return base_; }
+    PixelType* row(const unsigned y) { return reinterpret_cast<PixelType*>(base_ + size_t(stride_) * y); }
+    const PixelType* row(const unsigned y) const { return reinterpret_cast<const PixelType*>(base_ + size_t(stride_) * y); }
+
+    /**
+     * Describe tiles of this framebuffer, taking the stride from it.
+     * @param rowOrder BottomUp to store each tile's rows the other way up, ready
+     * to upload as a texture, while rows of tiles keep their places.
+     */
+    TileSpec tileSpec(const Dims2U tileDims, const RowOrder rowOrder = RowOrder::TopDown) const
+    {
+        return {PixelType::format, uint16_t(tileDims.w), uint16_t(tileDims.h), stride_, rowOrder};
+    }
+
+private:
+    Dims2U dims_;
+    unsigned stride_ = 0;
+    std::unique_ptr<uint8_t[]> storage_;
+    /// The first cacheline-aligned byte of storage_.
+    uint8_t* base_ = nullptr;
+};
+
+using Framebuffer = PaddedFramebuffer<RGBA>;
+
 /**
  * A bundle of pixel data. Derived classes know the format of the pixels and the
  * ownership of them.
@@ -89,48 +259,63 @@ struct Tile2D
 };
 
 /**
- * A tile which owns the pixels it points at, allocating and freeing a per-tile
- * framebuffer on creation / destruction.
+ * A tile which owns the pixels it points at, taking a block for them from the
+ * TileBlockPool for its size on creation and giving it back on destruction.
  * Constrained to be moveable but not copyable for simplicity.
  */
 template<typename PixelType>
 struct OwningTile2D : public Tile2D
 {
-    static unsigned created;
-    static unsigned destroyed;
-    OwningTile2D(uint16_t x, uint16_t y, uint16_t w, uint16_t h) : Tile2D(x, y)
+    static_assert(std::is_trivially_destructible<PixelType>::value, "Pixels live in raw pool blocks.");
+    static std::atomic<unsigned> created;
+    static std::atomic<unsigned> destroyed;
+    OwningTile2D(uint16_t x, uint16_t y, uint16_t w, uint16_t h) :
+        Tile2D(x, y), pool_(&TileBlockPool::forBlockSize(w * h * sizeof(PixelType)))
     {
-        pixels = reinterpret_cast<uint8_t*>(new PixelType[w*h]);
+        pixels = static_cast<uint8_t*>(pool_->allocate());
         ++created;
     }
     ~OwningTile2D()
     {
-        delete[] reinterpret_cast<PixelType*>(pixels);
-        pixels = 0;
+        release();
         ++destroyed;
     }
-    OwningTile2D(OwningTile2D&& rhs): Tile2D(std::move(rhs))
+    OwningTile2D(OwningTile2D&& rhs): Tile2D(rhs), pool_(rhs.pool_)
     {
-        delete[] reinterpret_cast<PixelType*>(pixels);
-        pixels = rhs.pixels;
-        rhs.pixels = 0;
+        rhs.pixels = nullptr;
     }
     OwningTile2D& operator = (OwningTile2D && rhs)
     {
-        delete[] reinterpret_cast<PixelType*>(pixels);
-        pixels = rhs.pixels;
-        rhs.pixels = 0;
+        if(this != &rhs)
+        {
+            release();
+            x = rhs.x;
+            y = rhs.y;
+            pixels = rhs.pixels;
+            pool_ = rhs.pool_;
+            rhs.pixels = nullptr;
+        }
         return *this;
     }
 private:
     OwningTile2D(const OwningTile2D& rhs) = delete;
     OwningTile2D& operator = (const OwningTile2D& rhs) = delete;
 
+    void release()
+    {
+        if(pixels)
+        {
+            pool_->deallocate(pixels);
+            pixels = nullptr;
+        }
+    }
+
+    TileBlockPool* pool_;
 };
 template <typename PixelType>
-unsigned OwningTile2D<PixelType>::created = 0;
+std::atomic<unsigned> OwningTile2D<PixelType>::created {0};
 template <typename PixelType>
-unsigned OwningTile2D<PixelType>::destroyed = 0;
+std::atomic<unsigned> OwningTile2D<PixelType>::destroyed {0};
 
 /**
  * Version of std::async that always uses the async launch policy.
@@ -142,6 +327,17 @@ LaunchAsync(Fn&& fn, Args&&... args)
     return std::async(std::launch::async, std::forward<Fn>(fn), std::forward<Args>(args)...);
 }
 
+/**
+ * Version of std::async that queues the work on the shared TilePool() rather
+ * than starting a thread for it.
+ */
+template<typename Fn, typename... Args>
+inline std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+LaunchPooled(Fn&& fn, Args&&... args)
+{
+    return TilePool().submit(std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
 /**
  * @brief Gets every element in a container of futures.
  * Effectively a barrier on the completion of a bunch of async work.
@@ -167,20 +363,10 @@ void waitAll(FutureContainer& futures)
     //fputs("\n", stderr);
 }
 
-/**
- * Round up a number to a multiple of the length of a cacheline.
- * @param i The memory address or size to round up.
- * @param cachelineLength The length of cachelines of interest on the platform.
- * @return The rounded-up value.
- */
-inline constexpr unsigned RoundUpToCacheline(unsigned i, unsigned cachelineLength)
-{
-    return (i / cachelineLength + (i % cachelineLength > 0)) * cachelineLength;
-}
-
 /**
  * Launch a function to run asynchronously on each tile of a framebuffer,
  * where the tiles own their own little framebuffers.
+ * The work is queued on the shared TilePool().
  * @return A vector of futures of whatever the launched function returns,
  * which by convention should be references to tiles in outTiles.
  */
@@ -200,7 +386,7 @@ LaunchOwningTiles(const TileSpec &spec, const Dims2U bufferTiles,
             const Point2U tileCoords {x, y};
             //outTiles.push_back({uint16_t(tileCoords.x), uint16_t(tileCoords.y), spec.w, spec.h});
             outTiles.emplace(outTiles.end(), uint16_t(tileCoords.x), uint16_t(tileCoords.y), spec.w, spec.h);
-            auto task = LaunchAsync(std::forward<Fn>(func), spec, std::ref(outTiles.back()), std::forward<Args>(args)...);
+            auto task = LaunchPooled(func, spec, std::ref(outTiles.back()), args...);
             tasks.push_back(move(task));
         }
     }
@@ -210,16 +396,19 @@ LaunchOwningTiles(const TileSpec &spec, const Dims2U bufferTiles,
 /**
  * Launch a function to run asynchronously on each tile of a framebuffer,
  * where the tiles point into a common framebuffer.
+ * The work is queued on the shared TilePool().
  * @return A vector of futures of whatever the launched function returns,
  * which by convention should be references to tiles in outTiles.
  */
 template<typename PixelType, typename Fn, typename... Args>
 std::vector<std::future<typename std::result_of<Fn(const TileSpec& spec, Tile2D& tile, Args&&...)>::type>>
 LaunchTiles(const TileSpec &spec, const Dims2U bufferTiles,
-            std::vector<PixelType> &framebuffer,
+            PaddedFramebuffer<PixelType> &framebuffer,
             std::vector<Tile2D> &outTiles,
             Fn &&func, Args &&... args)
 {
+    assert(spec.stride == framebuffer.stride() && "Take tile specs from the framebuffer's tileSpec().");
+    assert(bufferTiles.w * spec.w <= framebuffer.width() && bufferTiles.h * spec.h <= framebuffer.height());
     outTiles.clear();
     outTiles.reserve(bufferTiles.w * bufferTiles.h);
     std::vector<std::future<typename std::result_of<Fn(const TileSpec& spec, Tile2D& tile, Args...)>::type>> tasks;
@@ -228,9 +417,9 @@ LaunchTiles(const TileSpec &spec, const Dims2U bufferTiles,
     {
         for(unsigned x = 0; x < bufferTiles.w; ++x)
         {
-            uint8_t * const tile_corner = reinterpret_cast<uint8_t*>(&framebuffer[0]) + y * spec.h * spec.stride + x * spec.w * sizeof(PixelType);
+            uint8_t * const tile_corner = reinterpret_cast<uint8_t*>(framebuffer.row(y * spec.h) + x * spec.w);
             outTiles.emplace(outTiles.end(), tile_corner, uint16_t(x), uint16_t(y));
-            auto task = LaunchAsync(std::forward<Fn>(func), spec, std::ref(outTiles.back()), std::forward<Args>(args)...);
+            auto task = LaunchPooled(func, spec, std::ref(outTiles.back()), args...);
             tasks.push_back(move(task));
             //fputs("l", stderr); fflush(stderr);
         }
@@ -257,7 +446,7 @@ constexpr Dims2U pixelDims(const TileSpec& spec, const Dims2U tileGridDims)
  */
 template<typename PixelType>
 constexpr PixelType* addressRow(const TileSpec& spec, const Tile2D& tile, const unsigned y) {
-    PixelType *pixelRow = reinterpret_cast<PixelType *>(tile.pixels + spec.stride * y);
+    PixelType *pixelRow = reinterpret_cast<PixelType *>(tile.pixels + spec.stride * (spec.rowOrder == RowOrder::BottomUp ? spec.h - 1u - y : y));
     return pixelRow;
 }
 
@@ -274,51 +463,638 @@ constexpr Point2U pixelPosition(const TileSpec& spec, const Tile2D& tile)
 }
 
 /**
- * Extract the pixels of the pile into a buffer in which the scanlines are contiguous.
- * @param spec
- * @param tile
- * @param buffer The output to hold the copied pixels.
+ * Shared by the tile tasks of a launch and whoever launched them so the launch
+ * can be abandoned.
+ * Cancelling drops the tiles still queued on a TileSchedule without running
+ * them, and tiles already running see cancelled() and stop at their next check.
+ * Every tile launched under the token is counted until it finishes or is
+ * dropped, so waitQuiesced() tells the launcher when the framebuffer and tiles
+ * are no longer being touched.
  */
-inline void copyTile(const TileSpec& spec, const Tile2D& tile, void* const buffer)
+class CancellationToken
 {
-    const unsigned width = spec.w;
-    const unsigned height = spec.h;
-    assert(buffer != nullptr);
+public:
+    CancellationToken() {}
+    CancellationToken(const CancellationToken&) = delete;
+    CancellationToken& operator = (const CancellationToken&) = delete;
+
+    /**
+     * Abandon the launch. Safe to call from any thread and more than once.
+     * Queued tiles are dropped on the calling thread before this returns.
+     */
+    void cancel()
+    {
+        std::vector<std::function<void()>> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            if(cancelled_.exchange(true))
+            {
+                return;
+            }
+            callbacks.swap(onCancel_);
+        }
+        for(auto& callback : callbacks)
+        {
+            callback();
+        }
+    }
+
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    /** Tiles launched under this token which haven't yet finished or been dropped. */
+    unsigned outstanding() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return outstanding_;
+    }
+
+    /** Block until every tile launched under this token has finished or been dropped. */
+    void waitQuiesced() const
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        quiesced_.wait(lock, [this]() { return outstanding_ == 0; });
+    }
 
-    switch(spec.pixelFormat) {
-        case TileFormat::RGBA8888: {
-            RGBA* out = reinterpret_cast<RGBA*>(buffer);
-            for(unsigned y = 0; y < height; ++y, out += width)
+    /**
+     * Have something called when the token is cancelled, straight away if it
+     * already has been.
+     */
+    void onCancel(std::function<void()> callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            if(!cancelled_)
             {
-                RGBA* row = addressRow<RGBA>(spec, tile, y);
-                for(unsigned x = 0; x < width; ++x)
+                onCancel_.push_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+    /** Count tiles in as they are launched. */
+    void started(const unsigned tiles)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        outstanding_ += tiles;
+    }
+
+    /** Count a tile out when it has finished or been dropped. */
+    void finished()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        assert(outstanding_ > 0);
+        if(--outstanding_ == 0)
+        {
+            quiesced_.notify_all();
+        }
+    }
+
+private:
+    std::atomic<bool> cancelled_ {false};
+    mutable std::mutex lock_;
+    mutable std::condition_variable quiesced_;
+    unsigned outstanding_ = 0; // Guarded by lock_.
+    std::vector<std::function<void()>> onCancel_; // Guarded by lock_.
+};
+
+/** @return true if token is not null and has been cancelled. */
+inline bool isCancelled(const std::shared_ptr<CancellationToken>& token)
+{
+    return token && token->cancelled();
+}
+
+/**
+ * A queue of tile tasks ordered by how close each tile is to a focus point, such
+ * as the centre of the viewport, the last touch or the anchor of a zoom, so the
+ * part of the image the user is looking at fills in first.
+ * The focus can be moved at any time, reordering the tiles which haven't started.
+ * Shared between the thread launching tiles, the GUI moving the focus and the
+ * pooled tasks taking tiles off it.
+ */
+class TileSchedule
+{
+public:
+    /** @param focus In framebuffer pixels. */
+    explicit TileSchedule(const Point2F focus = {0.0f, 0.0f}) : focus_(focus) {}
+
+    TileSchedule(const TileSchedule&) = delete;
+    TileSchedule& operator = (const TileSchedule&) = delete;
+
+    /** Move the focus, reprioritising all queued tiles around it. */
+    void setFocus(const Point2F focus)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        focus_ = focus;
+        for(Entry& entry : queue_)
+        {
+            entry.distance2 = distance2(entry.centre);
+        }
+        std::make_heap(queue_.begin(), queue_.end(), Further());
+    }
+
+    Point2F focus() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return focus_;
+    }
+
+    /** The point a tile's distance from the focus is measured from, in framebuffer pixels. */
+    static Point2F tileCentre(const TileSpec& spec, const Tile2D& tile)
+    {
+        const Point2U position = pixelPosition(spec, tile);
+        return {position.x + spec.w * 0.5f, position.y + spec.h * 0.5f};
+    }
+
+    /** Tiles queued and not yet started. */
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return queue_.size();
+    }
+
+    /**
+     * A task for the tile with its centre at the given pixel. If token is not
+     * null, dropCancelled() runs the task early once it is cancelled, which the
+     * task should take as its cue to skip the work.
+     */
+    struct Queued
+    {
+        Point2F centre;
+        std::function<void()> task;
+        const CancellationToken* token;
+    };
+
+    /**
+     * Queue a batch of tile tasks under one lock. Something must later call
+     * runNext() once for each, which LaunchTilesPrioritised() does.
+     */
+    void push(std::vector<Queued>&& tasks)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        queue_.reserve(queue_.size() + tasks.size());
+        for(Queued& queued : tasks)
+        {
+            queue_.push_back({distance2(queued.centre), queued.centre, std::move(queued.task), queued.token});
+        }
+        std::make_heap(queue_.begin(), queue_.end(), Further());
+    }
+
+    /**
+     * Run the queued task nearest the focus on the calling thread.
+     * @return false if there was nothing queued.
+     */
+    bool runNext()
+    {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            if(queue_.empty())
+            {
+                return false;
+            }
+            std::pop_heap(queue_.begin(), queue_.end(), Further());
+            task = std::move(queue_.back().task);
+            queue_.pop_back();
+        }
+        task();
+        return true;
+    }
+
+    /**
+     * Take the tasks of cancelled launches off the queue and run them on the
+     * calling thread so they can complete their futures without doing any work.
+     */
+    void dropCancelled()
+    {
+        std::vector<Entry> dropped;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            const auto live = std::partition(queue_.begin(), queue_.end(),
+                [](const Entry& entry) { return !entry.token || !entry.token->cancelled(); });
+            std::move(live, queue_.end(), std::back_inserter(dropped));
+            queue_.erase(live, queue_.end());
+            std::make_heap(queue_.begin(), queue_.end(), Further());
+        }
+        for(Entry& entry : dropped)
+        {
+            entry.task();
+        }
+    }
+
+private:
+    struct Entry
+    {
+        float distance2;
+        Point2F centre;
+        std::function<void()> task;
+        const CancellationToken* token;
+    };
+    /// Puts the nearest entry at the top of the heap.
+    struct Further
+    {
+        bool operator()(const Entry& a, const Entry& b) const { return a.distance2 > b.distance2; }
+    };
+
+    float distance2(const Point2F centre) const
+    {
+        const float dx = centre.x - focus_.x;
+        const float dy = centre.y - focus_.y;
+        return dx * dx + dy * dy;
+    }
+
+    mutable std::mutex lock_;
+    Point2F focus_;
+    std::vector<Entry> queue_;
+};
+
+/**
+ * A hook to fill a tile without running the tile function, e.g. from a cache.
+ * @return true if it filled the tile, false to leave it to the tile function.
+ */
+using TilePrefill = std::function<bool(const TileSpec& spec, Tile2D& tile)>;
+
+/** The default for the onFinished hook of LaunchTilesPrioritised(). */
+struct IgnoreFinishedTile
+{
+    void operator()(Tile2D&) const {}
+};
+
+/**
+ * As LaunchTiles(), but the tiles can run in order of their distance from the
+ * focus of a schedule rather than row by row, and be cancelled. The futures are
+ * always in row-major order.
+ * With a schedule, each tile is queued on it and a task which runs the nearest
+ * one queued is put on the pool for it, so moving the focus reorders all tiles
+ * not yet started.
+ * @param schedule If null, tiles are queued straight on the pool as LaunchTiles() does.
+ * @param cancellation If not null, the tiles are counted in on it and once it
+ * is cancelled, tiles still queued on the schedule are dropped and any which
+ * get to start return without calling func. Use one token per launch.
+ * @param func Must return the tile it was given, as that is what a dropped
+ * tile's future gets.
+ * @param onFinished Called with each tile once it is done with, however that
+ * came about, including by being dropped or by func throwing.
+ */
+template<typename PixelType, typename Fn, typename OnFinished = IgnoreFinishedTile>
+std::vector<std::future<Tile2D&>>
+LaunchTilesPrioritised(const std::shared_ptr<TileSchedule>& schedule,
+                       const std::shared_ptr<CancellationToken>& cancellation,
+                       const TileSpec &spec, const Dims2U bufferTiles,
+                       PaddedFramebuffer<PixelType> &framebuffer,
+                       std::vector<Tile2D> &outTiles,
+                       Fn &&func,
+                       OnFinished onFinished = OnFinished())
+{
+    static_assert(std::is_same<typename std::result_of<Fn(const TileSpec&, Tile2D&)>::type, Tile2D&>::value,
+                  "Tile functions must return the tile they are given.");
+    auto guarded = [func, cancellation, onFinished](const TileSpec& spec, Tile2D& tile) mutable -> Tile2D&
+    {
+        // Hand the tile on and count it out however it ends:
+        struct Finished
+        {
+            OnFinished& onFinished;
+            Tile2D& tile;
+            CancellationToken* const token;
+            ~Finished()
+            {
+                onFinished(tile);
+                if(token)
                 {
-                    out[x] = row[x];
+                    token->finished();
                 }
             }
-            break;
+        } finished {onFinished, tile, cancellation.get()};
+        return isCancelled(cancellation) ? tile : func(spec, tile);
+    };
+    if(cancellation)
+    {
+        cancellation->started(bufferTiles.w * bufferTiles.h);
+    }
+    if(!schedule)
+    {
+        return LaunchTiles(spec, bufferTiles, framebuffer, outTiles, guarded);
+    }
+    assert(spec.stride == framebuffer.stride() && "Take tile specs from the framebuffer's tileSpec().");
+    assert(bufferTiles.w * spec.w <= framebuffer.width() && bufferTiles.h * spec.h <= framebuffer.height());
+    outTiles.clear();
+    outTiles.reserve(bufferTiles.w * bufferTiles.h);
+    std::vector<std::future<Tile2D&>> tasks;
+    tasks.reserve(outTiles.capacity());
+    std::vector<TileSchedule::Queued> queued;
+    queued.reserve(outTiles.capacity());
+    for(unsigned y = 0; y < bufferTiles.h; ++y)
+    {
+        for(unsigned x = 0; x < bufferTiles.w; ++x)
+        {
+            uint8_t * const tile_corner = reinterpret_cast<uint8_t*>(framebuffer.row(y * spec.h) + x * spec.w);
+            outTiles.emplace(outTiles.end(), tile_corner, uint16_t(x), uint16_t(y));
+            Tile2D& tile = outTiles.back();
+            // std::function has to be copyable so the task is shared:
+            auto task = std::make_shared<std::packaged_task<Tile2D&()>>(
+                [guarded, spec, &tile]() mutable -> Tile2D& { return guarded(spec, tile); });
+            tasks.push_back(task->get_future());
+            queued.push_back({TileSchedule::tileCentre(spec, tile), [task]() { (*task)(); }, cancellation.get()});
         }
     }
+    schedule->push(std::move(queued));
+    if(cancellation)
+    {
+        const std::weak_ptr<TileSchedule> weakSchedule = schedule;
+        cancellation->onCancel([weakSchedule]()
+        {
+            if(const std::shared_ptr<TileSchedule> schedule = weakSchedule.lock())
+            {
+                schedule->dropCancelled();
+            }
+        });
+    }
+    for(size_t i = 0; i < tasks.size(); ++i)
+    {
+        LaunchPooled([schedule]() { schedule->runNext(); });
+    }
+    return tasks;
 }
 
+class TileStream;
+template<typename PixelType, typename Fn>
+TileStream LaunchTilesStreaming(const std::shared_ptr<TileSchedule>& schedule,
+                                const std::shared_ptr<CancellationToken>& cancellation,
+                                const TileSpec &spec, const Dims2U bufferTiles,
+                                PaddedFramebuffer<PixelType> &framebuffer,
+                                std::vector<Tile2D> &outTiles,
+                                Fn &&func,
+                                const TilePrefill& prefill = nullptr);
+
+/**
+ * The consumer end of a launch by LaunchTilesStreaming(): hands back its tiles
+ * in the order they finish, so one slow tile holds up nothing but itself.
+ * Tiles which were cancelled come through too, untouched.
+ * Only one thread may take tiles from a stream at a time. Move-only.
+ */
+class TileStream
+{
+public:
+    TileStream() {}
+    TileStream(TileStream&&) = default;
+    TileStream& operator = (TileStream&&) = default;
+
+    /** Tiles in the launch. */
+    size_t size() const { return state_ ? state_->tiles : 0; }
+
+    /** Tiles not yet taken from the stream. */
+    size_t remaining() const { return size() - taken_; }
+
+    /**
+     * Take the next tile to finish, sleeping until one does.
+     * @return nullptr once every tile has been taken.
+     */
+    Tile2D* pop()
+    {
+        if(remaining() == 0)
+        {
+            return nullptr;
+        }
+        Tile2D* const tile = state_->finished.pop();
+        ++taken_;
+        rethrowFailure();
+        return tile;
+    }
+
+    /** @return The next tile to finish if one already has, else nullptr. */
+    Tile2D* tryPop()
+    {
+        Tile2D* tile = nullptr;
+        if(remaining() > 0 && state_->finished.tryPop(tile))
+        {
+            ++taken_;
+            rethrowFailure();
+        }
+        return tile;
+    }
+
+    /**
+     * Take all the tiles which have finished, up to max, without blocking.
+     * @return The number of tiles appended to out.
+     */
+    size_t drain(std::vector<Tile2D*>& out, const size_t max = SIZE_MAX)
+    {
+        if(remaining() == 0)
+        {
+            return 0;
+        }
+        const size_t drained = state_->finished.drain(out, max);
+        taken_ += drained;
+        rethrowFailure();
+        return drained;
+    }
+
+    /** Take and discard all the tiles, a barrier on the launch completing. */
+    void waitAll()
+    {
+        while(pop())
+        {
+        }
+    }
+
+private:
+    template<typename PixelType, typename Fn>
+    friend TileStream LaunchTilesStreaming(const std::shared_ptr<TileSchedule>&, const std::shared_ptr<CancellationToken>&,
+                                           const TileSpec&, Dims2U, PaddedFramebuffer<PixelType>&, std::vector<Tile2D>&, Fn&&,
+                                           const TilePrefill&);
+
+    /** Shared with the tile tasks, which outlive the consumer if it is abandoned. */
+    struct State
+    {
+        explicit State(const size_t tiles) : tiles(tiles), finished(tiles) {}
+        const size_t tiles;
+        /// Never fills as it has room for every tile of the launch.
+        BoundedMpscQueue<Tile2D*> finished;
+        std::mutex failureLock;
+        std::exception_ptr failure; // Guarded by failureLock. The first exception thrown by a tile.
+        std::atomic<bool> failed {false};
+    };
+
+    explicit TileStream(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+    /** Throw the first exception from a tile function, once. */
+    void rethrowFailure()
+    {
+        if(state_->failed.load(std::memory_order_acquire) && !rethrown_)
+        {
+            rethrown_ = true;
+            std::lock_guard<std::mutex> lock(state_->failureLock);
+            std::rethrow_exception(state_->failure);
+        }
+    }
+
+    std::shared_ptr<State> state_;
+    size_t taken_ = 0;
+    bool rethrown_ = false;
+};
+
+/**
+ * As LaunchTilesPrioritised(), but the tiles are handed back through a stream
+ * in the order they finish rather than as futures in the order they launched.
+ * An exception thrown by func or prefill is rethrown by the next call which
+ * takes a tile from the stream.
+ * @param prefill If not null, tried on each tile as it starts, and func is
+ * skipped for the tiles it fills.
+ */
+template<typename PixelType, typename Fn>
+TileStream LaunchTilesStreaming(const std::shared_ptr<TileSchedule>& schedule,
+                                const std::shared_ptr<CancellationToken>& cancellation,
+                                const TileSpec &spec, const Dims2U bufferTiles,
+                                PaddedFramebuffer<PixelType> &framebuffer,
+                                std::vector<Tile2D> &outTiles,
+                                Fn &&func,
+                                const TilePrefill& prefill)
+{
+    const auto state = std::make_shared<TileStream::State>(bufferTiles.w * bufferTiles.h);
+    auto recording = [func, prefill, state](const TileSpec& spec, Tile2D& tile) mutable -> Tile2D&
+    {
+        try
+        {
+            return prefill && prefill(spec, tile) ? tile : func(spec, tile);
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lock(state->failureLock);
+            if(!state->failure)
+            {
+                state->failure = std::current_exception();
+                state->failed.store(true, std::memory_order_release);
+            }
+            return tile;
+        }
+    };
+    // The futures aren't needed as the stream is told about every tile, and
+    // dropping them doesn't block:
+    LaunchTilesPrioritised(schedule, cancellation, spec, bufferTiles, framebuffer, outTiles, recording,
+        [state](Tile2D& tile)
+        {
+            const bool pushed = state->finished.tryPush(&tile);
+            assert(pushed);
+            (void) pushed;
+        });
+    return TileStream(state);
+}
+
+/**
+ * Extract the pixels of the pile into a buffer in which the scanlines are
+ * contiguous, in the order they lie in memory. For tiles of a BottomUp spec
+ * that is ready to upload as a texture.
+ * @param spec
+ * @param tile
+ * @param buffer The output to hold the copied pixels, of
+ * bytesPerPixel(spec.pixelFormat) * spec.w * spec.h bytes.
+ */
+inline void copyTile(const TileSpec& spec, const Tile2D& tile, void* const buffer)
+{
+    assert(buffer != nullptr);
+    const size_t rowBytes = size_t(spec.w) * bytesPerPixel(spec.pixelFormat);
+    uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+    for(unsigned y = 0; y < spec.h; ++y, out += rowBytes)
+    {
+        std::memcpy(out, tile.pixels + size_t(spec.stride) * y, rowBytes);
+    }
+}
+
+/** As copyTile(), with the rows the other way up. */
 inline void copyTileFlipped(const TileSpec& spec, const Tile2D& tile, void* const buffer)
 {
-    const unsigned width = spec.w;
-    const unsigned height = spec.h;
     assert(buffer != nullptr);
+    const size_t rowBytes = size_t(spec.w) * bytesPerPixel(spec.pixelFormat);
+    uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+    for(unsigned y = spec.h; y-- > 0; out += rowBytes)
+    {
+        std::memcpy(out, tile.pixels + size_t(spec.stride) * y, rowBytes);
+    }
+}
 
-    switch(spec.pixelFormat) {
-        case TileFormat::RGBA8888: {
-            RGBA* out = reinterpret_cast<RGBA*>(buffer);
-            for(unsigned y = height - 1; y < height; --y, out += width)
+/**
+ * A rectangle of tiles which can go up to a texture together. Its tiles are
+ * a run of a list sorted by row then column, bottom row first.
+ */
+struct TileRun
+{
+    /// Index of the run's first tile in the list.
+    size_t first;
+    /// Bottom left tile and size, in tiles.
+    uint16_t x, y, w, h;
+};
+
+/**
+ * Merge tiles into as few rectangles as their list order allows: runs of
+ * horizontally adjacent tiles in a row, with consecutive rows stacked where
+ * they are full across the grid.
+ * @param first, last Tiles sorted by row then column, each at most once.
+ * @param tileOf Gives the Tile2D of an element of the list.
+ * @param gridWidth Tiles across the grid, to tell full rows.
+ * @param maxTiles The most tiles a rectangle can have, at least one.
+ * @param[out] runs Cleared and filled with rectangles covering the tiles in order.
+ */
+template<typename Iterator, typename TileOf>
+void coalesceTiles(const Iterator first, const Iterator last, TileOf tileOf, const unsigned gridWidth, const size_t maxTiles, std::vector<TileRun>& runs)
+{
+    assert(maxTiles > 0);
+    runs.clear();
+    size_t index = 0;
+    for(Iterator it = first; it != last; ++index)
+    {
+        const Tile2D& start = tileOf(*it);
+        TileRun run {index, start.x, start.y, 1, 1};
+        for(++it; it != last; ++it)
+        {
+            const Tile2D& next = tileOf(*it);
+            if(next.y != run.y || next.x != run.x + run.w || size_t(run.w) >= maxTiles)
             {
-                RGBA* row = addressRow<RGBA>(spec, tile, y);
-                for(unsigned x = 0; x < width; ++x)
-                {
-                    out[x] = row[x];
-                }
+                break;
+            }
+            ++run.w;
+            ++index;
+        }
+        // A row full across the grid on top of another makes a rectangle of the atlas with it,
+        // and its tiles follow that row's in the list, so it joins it:
+        if(run.x == 0 && unsigned(run.w) == gridWidth && !runs.empty())
+        {
+            TileRun& below = runs.back();
+            if(below.x == 0 && unsigned(below.w) == gridWidth && below.y + below.h == run.y && size_t(below.h + 1) * below.w <= maxTiles)
+            {
+                ++below.h;
+                continue;
+            }
+        }
+        runs.push_back(run);
+    }
+}
+
+/**
+ * As copyTile(), for all the tiles of a rectangle at once: their scanlines are
+ * extracted into the pixels of the rectangle they cover, ready to upload with
+ * one call.
+ * @param spec
+ * @param run
+ * @param tileOf Gives the i'th tile of the run.
+ * @param buffer The output, of bytesPerPixel(spec.pixelFormat) * spec.w *
+ * spec.h bytes for each tile of the run. Row y of tile i in the run lands on
+ * row (i / run.w) * spec.h + y, in memory order like copyTile().
+ */
+template<typename TileOf>
+void packTileRun(const TileSpec& spec, const TileRun& run, TileOf tileOf, void* const buffer)
+{
+    assert(buffer != nullptr);
+    const size_t rowBytes = size_t(spec.w) * bytesPerPixel(spec.pixelFormat);
+    uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+    for(unsigned tileY = 0; tileY < run.h; ++tileY)
+    {
+        for(unsigned y = 0; y < spec.h; ++y)
+        {
+            for(unsigned tileX = 0; tileX < run.w; ++tileX, out += rowBytes)
+            {
+                const Tile2D& tile = tileOf(size_t(tileY) * run.w + tileX);
+                std::memcpy(out, tile.pixels + size_t(spec.stride) * y, rowBytes);
             }
-            break;
         }
     }
 }
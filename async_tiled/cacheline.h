@@ -0,0 +1,17 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_CACHELINE_H
+#define ASYNC_TILED_CACHELINE_H
+
+namespace async_tiled
+{
+
+/** The cacheline length framebuffers pad and align to, and shared atomics are padded apart by. Should pull this from the OS. */
+constexpr unsigned CACHELINE_LENGTH = 128u;
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_CACHELINE_H
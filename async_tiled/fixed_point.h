@@ -0,0 +1,414 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_FIXED_POINT_H
+#define ASYNC_TILED_FIXED_POINT_H
+#include <cmath>
+#include <cstdint>
+
+namespace async_tiled
+{
+
+/**
+ * A signed fixed-point number of Limbs 32 bit limbs in two's complement.
+ * The most significant limb is the integer part and the rest are fraction, so
+ * values run from -2^31 to 2^31 in steps of 2^(-32 * (Limbs - 1)).
+ * That is plenty of range for z^2 + c, which escapes long before |z| reaches 10,
+ * and the limb count sets the precision at compile time.
+ * Limbs are stored least significant first and only need 32x32->64 bit
+ * multiplies, so this is portable to everything we ship on.
+ */
+template<unsigned Limbs>
+class FixedPoint
+{
+    static_assert(Limbs >= 2, "Need at least one limb of integer and one of fraction.");
+public:
+    static constexpr unsigned LIMBS = Limbs;
+    static constexpr unsigned FRACTION_BITS = 32u * (Limbs - 1);
+
+    FixedPoint() : limbs_() {}
+
+    /** Exact for any double within range whose lowest set bit is inside the fraction. */
+    FixedPoint(const double d) : limbs_()
+    {
+        double magnitude = std::fabs(d);
+        double whole = std::floor(magnitude);
+        limbs_[Limbs - 1] = uint32_t(whole);
+        for(unsigned i = Limbs - 1; i-- > 0; )
+        {
+            magnitude = (magnitude - whole) * 4294967296.0;
+            whole = std::floor(magnitude);
+            limbs_[i] = uint32_t(whole);
+        }
+        if(d < 0.0)
+        {
+            negate();
+        }
+    }
+
+    /** Change the number of limbs, truncating or zero-extending the fraction. */
+    template<unsigned OtherLimbs>
+    explicit FixedPoint(const FixedPoint<OtherLimbs>& other) : limbs_()
+    {
+        for(unsigned i = 0; i < Limbs && i < OtherLimbs; ++i)
+        {
+            limbs_[Limbs - 1 - i] = other.limb(OtherLimbs - 1 - i);
+        }
+    }
+
+    explicit operator double() const
+    {
+        if(negative())
+        {
+            return -double(-*this);
+        }
+        double result = 0.0;
+        for(unsigned i = 0; i < Limbs; ++i)
+        {
+            result += std::ldexp(double(limbs_[i]), int(32 * i) - int(FRACTION_BITS));
+        }
+        return result;
+    }
+
+    bool negative() const { return (limbs_[Limbs - 1] >> 31) != 0; }
+    uint32_t limb(const unsigned i) const { return limbs_[i]; }
+    uint32_t& limb(const unsigned i) { return limbs_[i]; }
+
+    /** Two's complement negation in place. */
+    void negate()
+    {
+        uint64_t carry = 1;
+        for(unsigned i = 0; i < Limbs; ++i)
+        {
+            const uint64_t sum = uint64_t(uint32_t(~limbs_[i])) + carry;
+            limbs_[i] = uint32_t(sum);
+            carry = sum >> 32;
+        }
+    }
+
+    FixedPoint operator - () const
+    {
+        FixedPoint result = *this;
+        result.negate();
+        return result;
+    }
+
+    FixedPoint abs() const { return negative() ? -*this : *this; }
+
+    FixedPoint& operator += (const FixedPoint& rhs)
+    {
+        uint64_t carry = 0;
+        for(unsigned i = 0; i < Limbs; ++i)
+        {
+            const uint64_t sum = uint64_t(limbs_[i]) + rhs.limbs_[i] + carry;
+            limbs_[i] = uint32_t(sum);
+            carry = sum >> 32;
+        }
+        return *this;
+    }
+
+    FixedPoint& operator -= (const FixedPoint& rhs)
+    {
+        uint64_t borrow = 0;
+        for(unsigned i = 0; i < Limbs; ++i)
+        {
+            const uint64_t difference = uint64_t(limbs_[i]) - rhs.limbs_[i] - borrow;
+            limbs_[i] = uint32_t(difference);
+            borrow = (difference >> 32) & 1u;
+        }
+        return *this;
+    }
+
+    /**
+     * Product of two non-negative values, computed column by column from the top
+     * down to one guard column below the result. Dropping the columns under that
+     * makes it a truncated multiply, low by at most two units in the last place.
+     */
+    static FixedPoint multiplyMagnitudes(const FixedPoint& a, const FixedPoint& b)
+    {
+        FixedPoint result;
+        uint64_t acc = 0;
+        uint32_t accHigh = 0;
+        for(unsigned k = Limbs - 2; k <= 2 * Limbs - 2; ++k)
+        {
+            const unsigned first = k >= Limbs ? k - (Limbs - 1) : 0;
+            const unsigned last = k < Limbs ? k : Limbs - 1;
+            for(unsigned i = first; i <= last; ++i)
+            {
+                const uint64_t product = uint64_t(a.limbs_[i]) * b.limbs_[k - i];
+                acc += product;
+                accHigh += acc < product;
+            }
+            if(k >= Limbs - 1)
+            {
+                result.limbs_[k - (Limbs - 1)] = uint32_t(acc);
+            }
+            acc = (acc >> 32) | (uint64_t(accHigh) << 32);
+            accHigh = 0;
+        }
+        return result;
+    }
+
+    /**
+     * Square of a non-negative value. Each cross product a_i a_j turns up twice in
+     * a column so it is only multiplied once and the column sum doubled, nearly
+     * halving the multiplies.
+     */
+    static FixedPoint squareMagnitude(const FixedPoint& a)
+    {
+        FixedPoint result;
+        uint64_t acc = 0;
+        uint32_t accHigh = 0;
+        for(unsigned k = Limbs - 2; k <= 2 * Limbs - 2; ++k)
+        {
+            const unsigned first = k >= Limbs ? k - (Limbs - 1) : 0;
+            uint64_t cross = 0;
+            uint32_t crossHigh = 0;
+            for(unsigned i = first; 2 * i < k; ++i)
+            {
+                const uint64_t product = uint64_t(a.limbs_[i]) * a.limbs_[k - i];
+                cross += product;
+                crossHigh += cross < product;
+            }
+            crossHigh = (crossHigh << 1) | uint32_t(cross >> 63);
+            cross <<= 1;
+            if((k & 1u) == 0)
+            {
+                const uint64_t diagonal = uint64_t(a.limbs_[k / 2]) * a.limbs_[k / 2];
+                cross += diagonal;
+                crossHigh += cross < diagonal;
+            }
+            acc += cross;
+            accHigh += crossHigh + (acc < cross);
+            if(k >= Limbs - 1)
+            {
+                result.limbs_[k - (Limbs - 1)] = uint32_t(acc);
+            }
+            acc = (acc >> 32) | (uint64_t(accHigh) << 32);
+            accHigh = 0;
+        }
+        return result;
+    }
+
+    /** Quotient of two non-negative values by restoring long division, a bit at a time. */
+    static FixedPoint divideMagnitudes(const FixedPoint& a, const FixedPoint& b)
+    {
+        // The numerator is a shifted up by the fraction bits: a's limbs above Limbs - 1 zero limbs.
+        constexpr unsigned NUMERATOR_LIMBS = 2 * Limbs - 1;
+        FixedPoint result;
+        uint32_t remainder[Limbs + 1] = {};
+        for(unsigned bit = NUMERATOR_LIMBS * 32; bit-- > 0; )
+        {
+            const unsigned numeratorLimb = bit / 32;
+            const uint32_t nextBit = numeratorLimb >= Limbs - 1 ? (a.limbs_[numeratorLimb - (Limbs - 1)] >> (bit % 32)) & 1u : 0u;
+            // remainder = remainder * 2 + nextBit:
+            for(unsigned i = Limbs + 1; i-- > 1; )
+            {
+                remainder[i] = (remainder[i] << 1) | (remainder[i - 1] >> 31);
+            }
+            remainder[0] = (remainder[0] << 1) | nextBit;
+            // If remainder >= b, subtract it and set the quotient bit:
+            bool greaterOrEqual = remainder[Limbs] != 0;
+            if(!greaterOrEqual)
+            {
+                greaterOrEqual = true;
+                for(unsigned i = Limbs; i-- > 0; )
+                {
+                    if(remainder[i] != b.limbs_[i])
+                    {
+                        greaterOrEqual = remainder[i] > b.limbs_[i];
+                        break;
+                    }
+                }
+            }
+            if(greaterOrEqual)
+            {
+                uint64_t borrow = 0;
+                for(unsigned i = 0; i < Limbs + 1; ++i)
+                {
+                    const uint64_t difference = uint64_t(remainder[i]) - (i < Limbs ? b.limbs_[i] : 0u) - borrow;
+                    remainder[i] = uint32_t(difference);
+                    borrow = (difference >> 32) & 1u;
+                }
+                if(bit < Limbs * 32)
+                {
+                    result.limbs_[bit / 32] |= 1u << (bit % 32);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    uint32_t limbs_[Limbs];
+};
+
+template<unsigned Limbs>
+inline FixedPoint<Limbs> operator + (FixedPoint<Limbs> a, const FixedPoint<Limbs>& b)
+{
+    return a += b;
+}
+
+template<unsigned Limbs>
+inline FixedPoint<Limbs> operator - (FixedPoint<Limbs> a, const FixedPoint<Limbs>& b)
+{
+    return a -= b;
+}
+
+/** The square of a value, whatever its sign. */
+template<unsigned Limbs>
+inline FixedPoint<Limbs> square(const FixedPoint<Limbs>& a)
+{
+    return FixedPoint<Limbs>::squareMagnitude(a.abs());
+}
+
+/** Multiplying something by itself, as in zr * zr, takes the squaring path. */
+template<unsigned Limbs>
+inline FixedPoint<Limbs> operator * (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b)
+{
+    if(&a == &b)
+    {
+        return square(a);
+    }
+    FixedPoint<Limbs> product = FixedPoint<Limbs>::multiplyMagnitudes(a.abs(), b.abs());
+    if(a.negative() != b.negative())
+    {
+        product.negate();
+    }
+    return product;
+}
+
+template<unsigned Limbs>
+inline FixedPoint<Limbs> operator / (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b)
+{
+    FixedPoint<Limbs> quotient = FixedPoint<Limbs>::divideMagnitudes(a.abs(), b.abs());
+    if(a.negative() != b.negative())
+    {
+        quotient.negate();
+    }
+    return quotient;
+}
+
+template<unsigned Limbs>
+inline bool operator < (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b)
+{
+    if(a.limb(Limbs - 1) != b.limb(Limbs - 1))
+    {
+        return int32_t(a.limb(Limbs - 1)) < int32_t(b.limb(Limbs - 1));
+    }
+    for(unsigned i = Limbs - 1; i-- > 0; )
+    {
+        if(a.limb(i) != b.limb(i))
+        {
+            return a.limb(i) < b.limb(i);
+        }
+    }
+    return false;
+}
+template<unsigned Limbs>
+inline bool operator > (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b) { return b < a; }
+template<unsigned Limbs>
+inline bool operator >= (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b) { return !(a < b); }
+template<unsigned Limbs>
+inline bool operator <= (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b) { return !(b < a); }
+template<unsigned Limbs>
+inline bool operator == (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b)
+{
+    for(unsigned i = 0; i < Limbs; ++i)
+    {
+        if(a.limb(i) != b.limb(i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+template<unsigned Limbs>
+inline bool operator != (const FixedPoint<Limbs>& a, const FixedPoint<Limbs>& b) { return !(a == b); }
+
+/**
+ * floor(x / 2^exponent): the index of the cell holding x in a grid of
+ * power-of-two sized cells anchored at zero. Exact at any depth, but wraps if
+ * the index doesn't fit in 64 bits.
+ */
+template<unsigned Limbs>
+int64_t floorDivPowerOfTwo(const FixedPoint<Limbs>& x, const int exponent)
+{
+    // Bit b of the index is bit b + shift of x, sign-extended past the top:
+    const int shift = int(FixedPoint<Limbs>::FRACTION_BITS) + exponent;
+    uint64_t index = 0;
+    for(int b = 0; b < 64; ++b)
+    {
+        const int bit = b + shift;
+        const uint64_t value = bit < 0 ? 0u : bit >= int(32 * Limbs) ? uint64_t(x.negative()) : (x.limb(unsigned(bit) / 32) >> (unsigned(bit) % 32)) & 1u;
+        index |= value << unsigned(b);
+    }
+    return int64_t(index);
+}
+
+/** n * 2^exponent, the corner of a cell of floorDivPowerOfTwo(). Exact while it is in range. */
+template<unsigned Limbs>
+FixedPoint<Limbs> timesPowerOfTwo(const int64_t n, const int exponent)
+{
+    const int shift = int(FixedPoint<Limbs>::FRACTION_BITS) + exponent;
+    FixedPoint<Limbs> result;
+    for(int bit = 0; bit < int(32 * Limbs); ++bit)
+    {
+        const int b = bit - shift;
+        const uint32_t value = b < 0 ? 0u : b >= 64 ? uint32_t(n < 0) : uint32_t(uint64_t(n) >> unsigned(b)) & 1u;
+        result.limb(unsigned(bit) / 32) |= value << (unsigned(bit) % 32);
+    }
+    return result;
+}
+
+/**
+ * Limbs used for coordinates of regions in the GUI and the launchers: 224 bits
+ * of fraction, which is deeper than anyone will zoom with the iteration counts
+ * we run at.
+ */
+constexpr unsigned COORDINATE_LIMBS = 8;
+using Coordinate = FixedPoint<COORDINATE_LIMBS>;
+
+/**
+ * Convert a fixed-point number to another real type by summing its limbs in
+ * that type, so types wider than double keep all the bits they can hold.
+ */
+template<typename Real>
+struct FixedPointConverter
+{
+    template<unsigned Limbs>
+    static Real convert(const FixedPoint<Limbs>& x)
+    {
+        if(x.negative())
+        {
+            return Real(0) - convert(-x);
+        }
+        Real result(0);
+        for(unsigned i = 0; i < Limbs; ++i)
+        {
+            result = result + Real(std::ldexp(double(x.limb(i)), int(32 * i) - int(FixedPoint<Limbs>::FRACTION_BITS)));
+        }
+        return result;
+    }
+};
+template<unsigned ToLimbs>
+struct FixedPointConverter<FixedPoint<ToLimbs>>
+{
+    template<unsigned Limbs>
+    static FixedPoint<ToLimbs> convert(const FixedPoint<Limbs>& x)
+    {
+        return FixedPoint<ToLimbs>(x);
+    }
+};
+
+template<typename Real, unsigned Limbs>
+inline Real fixedPointTo(const FixedPoint<Limbs>& x)
+{
+    return FixedPointConverter<Real>::convert(x);
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_FIXED_POINT_H
@@ -6,60 +6,409 @@
 #ifndef ASYNC_TILED_FRACTALS_H
 #define ASYNC_TILED_FRACTALS_H
 #include "async_tiled.h"
+#include "simd_kernels.h"
+#include "real_types.h"
+#include "perturbation.h"
+#include "palette.h"
+#include <algorithm>
 #include <cmath>
 #include <complex>
 
 
 namespace async_tiled {
 
+/**
+ * The samples of a render at half the resolution, to seed a render with after a
+ * 2x zoom in: every other pixel of every other row of the new render lands
+ * exactly on a coarse one, so only the other three quarters need iterating.
+ * New pixel (2x, 2y) is coarse pixel (offsetX + x, offsetY + y), so the pixel
+ * lattices of the two renders must line up, as snapping both to world tiles
+ * makes them.
+ */
+struct CoarseSamples
+{
+    /// Null for no seeding.
+    const IterationBuffer* iterations = nullptr;
+    /// The coarse pixel under new pixel (0, 0). May be negative.
+    int offsetX = 0;
+    int offsetY = 0;
+    /// Whether the coarse sample at a pixel is final. If null, all are.
+    std::function<bool(unsigned x, unsigned y)> finished;
+
+    /**
+     * Whether all the coarse samples under a tile of the new render are there
+     * to use.
+     * @param[out] coarsePosition The coarse pixel under the tile's first pixel.
+     */
+    bool cover(const TileSpec& spec, const Tile2D& tile, const bool smooth, Point2U& coarsePosition) const
+    {
+        if(!iterations || spec.w % 2 || spec.h % 2 || (smooth && !iterations->smooth()))
+        {
+            return false;
+        }
+        const Point2U position = pixelPosition(spec, tile);
+        const int64_t x0 = offsetX + int64_t(position.x / 2);
+        const int64_t y0 = offsetY + int64_t(position.y / 2);
+        const int64_t x1 = x0 + spec.w / 2 - 1;
+        const int64_t y1 = y0 + spec.h / 2 - 1;
+        if(x0 < 0 || y0 < 0 || x1 >= iterations->dims.w || y1 >= iterations->dims.h)
+        {
+            return false;
+        }
+        coarsePosition = {unsigned(x0), unsigned(y0)};
+        // A tile's samples are all final or none are, so it is enough to ask about
+        // the corners of the block, which lie in every coarse tile it touches:
+        return !finished || (finished(unsigned(x0), unsigned(y0)) && finished(unsigned(x1), unsigned(y0)) &&
+                             finished(unsigned(x0), unsigned(y1)) && finished(unsigned(x1), unsigned(y1)));
+    }
+};
+
 /** Do a mandelbrot set, using the shared framebuffer form of tiles.
+ * All coordinate math and iteration is done in Real, one of the types in
+ * real_types.h.
+ * Each tile iterates into its part of iterations then colours itself from that
+ * with paletteTile(), so paletteAsyncTiled() can recolour it later without
+ * iterating again. iterations and palette must outlive the tasks.
+ * @param seed Reuse the samples of the previous render on a 2x zoom in, which
+ * must outlive the tasks. The seeded pixels may differ from iterating them
+ * where rounding of the coordinates in Real puts them either side of an edge.
+ * @return The tiles, in the order they finish.
  * ToDo, add clipping. */
-std::vector <std::future<Tile2D &>> mandelbrotAsyncTiled(
-        const float left, const float right, const float top, const float bottom,
+template<typename Real, typename PixelType>
+TileStream mandelbrotAsyncTiled(
+        const Real left, const Real right, const Real top, const Real bottom,
         const unsigned maxIters,
-        const uint16_t originalTransaction,
-        /// When this no longer matches originalTransaction, the async operations will be abandoned.
-        std::atomic<uint16_t>& transaction,
-        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, Framebuffer &framebuffer)
+        /// When cancelled, the async operations will be abandoned. May be null.
+        const std::shared_ptr<CancellationToken>& cancellation,
+        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, PaddedFramebuffer<PixelType>& framebuffer,
+        IterationBuffer& iterations, const PaletteLut& palette,
+        /// Row kernel to iterate with. Defaults to the widest SIMD one the CPU supports.
+        const MandelbrotRowFn<Real> kernel = MandelbrotRow<Real>(),
+        /// If not null, tiles run nearest its focus first.
+        const std::shared_ptr<TileSchedule>& schedule = nullptr,
+        /// If not null, tried on each tile first. The tiles it fills are not iterated.
+        const TilePrefill& prefill = nullptr,
+        const CoarseSamples& seed = CoarseSamples())
 {
     const Dims2U framebufferDims = pixelDims(spec, tileGridDims);
 
-    std::vector <std::future<Tile2D &>> futureTiles = LaunchTiles(spec, tileGridDims, framebuffer, tiles,
-        [top, left, bottom, right, maxIters, framebufferDims, originalTransaction, &transaction](const TileSpec &spec, Tile2D &tile/*, std::atomic<uint16_t>& transaction*/) -> Tile2D &
+    TileStream finishedTiles = LaunchTilesStreaming(schedule, cancellation, spec, tileGridDims, framebuffer, tiles,
+        [top, left, bottom, right, maxIters, framebufferDims, cancellation, &iterations, &palette, kernel, seed](const TileSpec &spec, Tile2D &tile) -> Tile2D &
     {
         const Point2U framebufferPosition = pixelPosition(spec, tile);
+        // A row of c values in, a row of iteration counts out:
+        static thread_local std::vector<Real> realCoords;
+        realCoords.resize(spec.w);
+        // The odd pixels of rows which are half seeded:
+        static thread_local std::vector<uint32_t> oddCounts;
+        static thread_local std::vector<float> oddFractions;
+        Point2U coarsePosition;
+        const bool seeded = seed.cover(spec, tile, iterations.smooth(), coarsePosition);
+        if(seeded)
+        {
+            oddCounts.resize(spec.w / 2);
+            oddFractions.resize(iterations.smooth() ? spec.w / 2 : 0);
+        }
+        // Divide once per tile as division is slow in the software types:
+        const Real stepX = (right - left) / Real(double(framebufferDims.w));
+        const Real stepY = (bottom - top) / Real(double(framebufferDims.h));
         for (unsigned y = 0; y < spec.h; ++y) {
             // Allow cancelation per scanline so we don't burn cycles if this tile becomes
             // out of date before it is even fully generated:
-            if(transaction != originalTransaction)
+            if(isCancelled(cancellation))
             {
-                break;
+                return tile;
             }
             const unsigned framebufferY = framebufferPosition.y + y;
-            const float j = top + (bottom - top) / framebufferDims.h * framebufferY;
-            RGBA *const pixelRow = addressRow<RGBA>(spec, tile, y);
-            for (unsigned x = 0; x < spec.w; ++x) {
-                const unsigned frameBufferX = framebufferPosition.x + x;
-                const float i = left + (right - left) / framebufferDims.w * frameBufferX;
-                const std::complex<float> c = {i, j};
-                std::complex<float> z = {0, 0};
-                unsigned iter = 0;
-                for (; iter < maxIters; ++iter) {
-                    z = z * z + c;
-                    if (fabsf(z.real() * z.imag()) >= 4.0f) {
-                        break;
+            const Real j = top + stepY * Real(double(framebufferY));
+            uint32_t* const counts = iterations.countRow(spec, tile, y);
+            float* const fractions = iterations.fractionRow(spec, tile, y);
+            if(seeded && y % 2 == 0)
+            {
+                // The even pixels of even rows are in the coarse samples, so only iterate the odd ones:
+                for (unsigned x = 1; x < spec.w; x += 2) {
+                    realCoords[x / 2] = left + stepX * Real(double(framebufferPosition.x + x));
+                }
+                kernel(&realCoords[0], j, spec.w / 2, maxIters, &oddCounts[0], fractions ? &oddFractions[0] : nullptr);
+                const size_t coarseRow = size_t(coarsePosition.y + y / 2) * seed.iterations->dims.w + coarsePosition.x;
+                for (unsigned x = 0; x < spec.w; x += 2) {
+                    counts[x] = seed.iterations->counts[coarseRow + x / 2];
+                    counts[x + 1] = oddCounts[x / 2];
+                    if(fractions)
+                    {
+                        fractions[x] = seed.iterations->fractions[coarseRow + x / 2];
+                        fractions[x + 1] = oddFractions[x / 2];
                     }
                 }
-                const uint8_t grey = uint8_t(255.0f / maxIters * (maxIters - iter));
-                pixelRow[x] = {grey, grey, grey, 255};
+                continue;
+            }
+            for (unsigned x = 0; x < spec.w; ++x) {
+                const unsigned frameBufferX = framebufferPosition.x + x;
+                realCoords[x] = left + stepX * Real(double(frameBufferX));
             }
+            kernel(&realCoords[0], j, spec.w, maxIters, counts, fractions);
         }
         // Use this to see a progressive load of tile:
         // std::this_thread::sleep_for(std::chrono::milliseconds(1*tile.x*tile.y));
-        return tile;
+        return paletteTile(spec, tile, iterations, palette);
+
+    }, prefill);
+    return finishedTiles;
+}
+
+/** Counts of how a set of tiles were filled in by mandelbrotSubdividedAsyncTiled(). */
+struct SubdivisionStats
+{
+    std::atomic<uint64_t> computedPixels {0};
+    /// Pixels inside rectangles whose borders all had the same count, filled without iterating.
+    std::atomic<uint64_t> filledPixels {0};
 
-    });//, transaction);
-    return futureTiles;
+    double skippedFraction() const
+    {
+        const double total = double(computedPixels.load() + filledPixels.load());
+        return total > 0.0 ? filledPixels.load() / total : 0.0;
+    }
+};
+
+/** Rectangles with no more than this many pixels inside their border on a side are iterated rather than split. */
+constexpr unsigned SUBDIVISION_MIN_SIZE = 6;
+
+/**
+ * As mandelbrotAsyncTiled() but each tile is solved by Mariani-Silver
+ * subdivision: the border of the tile is iterated first and if every pixel on
+ * it has the same count the inside is filled with that count. Otherwise the tile
+ * is split into quadrants by iterating a row and a column through its middle,
+ * which become part of the borders of the quadrants, and each is dealt with the
+ * same way.
+ * The Mandelbrot set is connected, so a border which is all inside the set can
+ * have nothing outside it, making this exact for interior regions. Bands of a
+ * single escape count can hide detail smaller than a pixel, as sampling always
+ * could. When iterations is smooth only interior rectangles are filled, as the
+ * fractions across a band differ.
+ */
+template<typename Real, typename PixelType>
+TileStream mandelbrotSubdividedAsyncTiled(
+        const Real left, const Real right, const Real top, const Real bottom,
+        const unsigned maxIters,
+        /// When cancelled, the async operations will be abandoned. May be null.
+        const std::shared_ptr<CancellationToken>& cancellation,
+        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, PaddedFramebuffer<PixelType>& framebuffer,
+        IterationBuffer& iterations, const PaletteLut& palette,
+        SubdivisionStats* const stats = nullptr,
+        const MandelbrotRowFn<Real> kernel = MandelbrotRow<Real>(),
+        /// If not null, tiles run nearest its focus first.
+        const std::shared_ptr<TileSchedule>& schedule = nullptr,
+        /// If not null, tried on each tile first. The tiles it fills are not iterated.
+        const TilePrefill& prefill = nullptr)
+{
+    const Dims2U framebufferDims = pixelDims(spec, tileGridDims);
+
+    return LaunchTilesStreaming(schedule, cancellation, spec, tileGridDims, framebuffer, tiles,
+        [top, left, bottom, right, maxIters, framebufferDims, cancellation, &iterations, &palette, stats, kernel](const TileSpec &spec, Tile2D &tile) -> Tile2D &
+    {
+        const Point2U framebufferPosition = pixelPosition(spec, tile);
+        const Real stepX = (right - left) / Real(double(framebufferDims.w));
+        const Real stepY = (bottom - top) / Real(double(framebufferDims.h));
+        static thread_local std::vector<Real> realCoords;
+        realCoords.resize(spec.w);
+        auto countAt = [&](const unsigned x, const unsigned y) -> uint32_t& { return iterations.countRow(spec, tile, y)[x]; };
+        auto fractionsAt = [&](const unsigned x, const unsigned y) -> float* { return iterations.smooth() ? iterations.fractionRow(spec, tile, y) + x : nullptr; };
+        unsigned computed = 0;
+        unsigned filled = 0;
+
+        // Iterate a run of pixels along a row with one kernel call:
+        auto computeRow = [&](const unsigned y, const unsigned x0, const unsigned count)
+        {
+            for(unsigned x = 0; x < count; ++x)
+            {
+                realCoords[x] = left + stepX * Real(double(framebufferPosition.x + x0 + x));
+            }
+            const Real ci = top + stepY * Real(double(framebufferPosition.y + y));
+            kernel(&realCoords[0], ci, count, maxIters, &countAt(x0, y), fractionsAt(x0, y));
+            computed += count;
+        };
+        // Down a column each pixel has its own ci so they go one at a time:
+        auto computeColumn = [&](const unsigned x, const unsigned y0, const unsigned count)
+        {
+            const Real cr = left + stepX * Real(double(framebufferPosition.x + x));
+            for(unsigned y = y0; y < y0 + count; ++y)
+            {
+                const Real ci = top + stepY * Real(double(framebufferPosition.y + y));
+                kernel(&cr, ci, 1, maxIters, &countAt(x, y), fractionsAt(x, y));
+            }
+            computed += count;
+        };
+
+        // Inclusive bounds of a rectangle whose border has been iterated:
+        struct Rect { unsigned x0, y0, x1, y1; };
+        static thread_local std::vector<Rect> pending;
+        pending.clear();
+        computeRow(0, 0, spec.w);
+        if(spec.h > 1)
+        {
+            computeRow(spec.h - 1, 0, spec.w);
+        }
+        if(spec.h > 2)
+        {
+            computeColumn(0, 1, spec.h - 2);
+            if(spec.w > 1)
+            {
+                computeColumn(spec.w - 1, 1, spec.h - 2);
+            }
+        }
+        pending.push_back({0, 0, spec.w - 1u, spec.h - 1u});
+
+        while(!pending.empty())
+        {
+            // Allow cancelation per rectangle:
+            if(isCancelled(cancellation))
+            {
+                return tile;
+            }
+            const Rect rect = pending.back();
+            pending.pop_back();
+            if(rect.x1 - rect.x0 < 2 || rect.y1 - rect.y0 < 2)
+            {
+                continue; // It is all border.
+            }
+            const unsigned innerW = rect.x1 - rect.x0 - 1;
+            const unsigned innerH = rect.y1 - rect.y0 - 1;
+
+            const uint32_t first = countAt(rect.x0, rect.y0);
+            bool uniform = !iterations.smooth() || first >= maxIters;
+            for(unsigned x = rect.x0; x <= rect.x1 && uniform; ++x)
+            {
+                uniform = countAt(x, rect.y0) == first && countAt(x, rect.y1) == first;
+            }
+            for(unsigned y = rect.y0 + 1; y < rect.y1 && uniform; ++y)
+            {
+                uniform = countAt(rect.x0, y) == first && countAt(rect.x1, y) == first;
+            }
+            if(uniform)
+            {
+                for(unsigned y = rect.y0 + 1; y < rect.y1; ++y)
+                {
+                    std::fill_n(&countAt(rect.x0 + 1, y), innerW, first);
+                    if(float* const fractions = fractionsAt(rect.x0 + 1, y))
+                    {
+                        std::fill_n(fractions, innerW, 0.0f);
+                    }
+                }
+                filled += innerW * innerH;
+                continue;
+            }
+            if(innerW <= SUBDIVISION_MIN_SIZE || innerH <= SUBDIVISION_MIN_SIZE)
+            {
+                for(unsigned y = rect.y0 + 1; y < rect.y1; ++y)
+                {
+                    computeRow(y, rect.x0 + 1, innerW);
+                }
+                continue;
+            }
+            const unsigned midX = (rect.x0 + rect.x1) / 2;
+            const unsigned midY = (rect.y0 + rect.y1) / 2;
+            computeRow(midY, rect.x0 + 1, innerW);
+            computeColumn(midX, rect.y0 + 1, midY - rect.y0 - 1);
+            computeColumn(midX, midY + 1, rect.y1 - midY - 1);
+            pending.push_back({rect.x0, rect.y0, midX, midY});
+            pending.push_back({midX, rect.y0, rect.x1, midY});
+            pending.push_back({rect.x0, midY, midX, rect.y1});
+            pending.push_back({midX, midY, rect.x1, rect.y1});
+        }
+
+        if(stats)
+        {
+            stats->computedPixels += computed;
+            stats->filledPixels += filled;
+        }
+        return paletteTile(spec, tile, iterations, palette);
+    }, prefill);
+}
+
+/**
+ * Do a mandelbrot set in the cheapest real type that can still resolve the
+ * individual pixels of the region: float when zoomed out, up to long double
+ * directly, then by perturbation around a double-double or wider reference
+ * orbit when zoomed right in, and past the widest floating-point type, around
+ * a fixed-point one with as many limbs as the depth needs.
+ * The region is given as a centre and extent rather than edges so that the edges
+ * can be worked out in the chosen type rather than rounded to double. The centre
+ * is a fixed-point Coordinate so it can be placed exactly however deep the zoom.
+ * @param spanX Width of the region. Pixel column 0 is at centreX - spanX / 2.
+ * @param spanY Height of the region. Pixel row 0 is at centreY - spanY / 2, so
+ * pass a negative span to put the most positive imaginary values at the top.
+ * @param iterations, palette As for mandelbrotAsyncTiled().
+ * @param chosenType If not null, receives the type that was used.
+ * @param schedule If not null, tiles run nearest its focus first.
+ * @param prefill If not null, tried on each tile first. The tiles it fills are
+ * not iterated and their iterations are left as they were.
+ * @param seed As for mandelbrotAsyncTiled(). Only used at depths which are
+ * iterated directly rather than by perturbation.
+ */
+template<typename PixelType>
+TileStream mandelbrotAsyncTiledAutoPrecision(
+        const Coordinate& centreX, const Coordinate& centreY, const double spanX, const double spanY,
+        const unsigned maxIters,
+        const std::shared_ptr<CancellationToken>& cancellation,
+        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, PaddedFramebuffer<PixelType>& framebuffer,
+        IterationBuffer& iterations, const PaletteLut& palette,
+        RealType* const chosenType = nullptr,
+        const std::shared_ptr<TileSchedule>& schedule = nullptr,
+        const TilePrefill& prefill = nullptr,
+        const CoarseSamples& seed = CoarseSamples())
+{
+    const Dims2U framebufferDims = pixelDims(spec, tileGridDims);
+    const double pixelSpacing = std::fmin(std::fabs(spanX) / framebufferDims.w, std::fabs(spanY) / framebufferDims.h);
+    const double magnitude = std::fmax(std::fabs(double(centreX)) + std::fabs(spanX) * 0.5, std::fabs(double(centreY)) + std::fabs(spanY) * 0.5);
+    const RealType type = ChooseRealType(pixelSpacing, magnitude);
+    if(chosenType)
+    {
+        *chosenType = type;
+    }
+
+    // Edges are computed in the chosen type so the centre keeps all its bits:
+    auto launch = [&](auto zero) {
+        using Real = decltype(zero);
+        const Real halfX = Real(spanX * 0.5);
+        const Real halfY = Real(spanY * 0.5);
+        const Real realCentreX = fixedPointTo<Real>(centreX);
+        const Real realCentreY = fixedPointTo<Real>(centreY);
+        return mandelbrotAsyncTiled<Real>(realCentreX - halfX, realCentreX + halfX, realCentreY - halfY, realCentreY + halfY,
+                                          maxIters, cancellation, tileGridDims, spec, tiles, framebuffer, iterations, palette,
+                                          MandelbrotRow<Real>(), schedule, prefill, seed);
+    };
+    auto perturb = [&](auto zero) {
+        using HighReal = decltype(zero);
+        return mandelbrotPerturbationAsyncTiled(fixedPointTo<HighReal>(centreX), fixedPointTo<HighReal>(centreY), spanX, spanY,
+                                                maxIters, cancellation, tileGridDims, spec, tiles, framebuffer, iterations, palette,
+                                                true, nullptr, schedule, prefill);
+    };
+    switch(type) {
+        case RealType::Float:        return launch(float(0));
+        case RealType::Double:       return launch(double(0));
+        case RealType::LongDouble:   return launch((long double)(0));
+        // Past hardware precision only the reference orbit needs the wide type:
+        case RealType::DoubleDouble: return perturb(DoubleDouble(0));
+#if ASYNC_TILED_HAS_FLOAT128
+        case RealType::Float128:     return perturb(__float128(0));
+#endif
+        // Only a few limb counts are instantiated to keep the build time down:
+        case RealType::FixedPoint:
+        {
+            const unsigned limbs = FixedPointLimbsFor(pixelSpacing, magnitude);
+            if(limbs <= 4)
+            {
+                return perturb(FixedPoint<4>());
+            }
+            if(limbs <= 6)
+            {
+                return perturb(FixedPoint<6>());
+            }
+            return perturb(Coordinate());
+        }
+        default: break;
+    }
+    return launch(double(0));
 }
 }
 #endif //ASYNC_TILED_FRACTALS_H
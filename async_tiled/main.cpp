@@ -4,6 +4,9 @@
  */
 #include "fractals.h"
 #include "async_tiled.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+#include "staging_ring.h"
 #include <iostream>
 #include <future>
 #include <vector>
@@ -12,6 +15,12 @@
 #include <algorithm>
 #include <complex>
 #include <cmath>
+#include <chrono>
+#include <numeric>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <string>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
@@ -21,6 +30,7 @@ using namespace async_tiled;
 
 constexpr const char * const OUTPUT_PATH_CLEAR = "/tmp/async_tiled-clear.png";
 constexpr const char * const OUTPUT_PATH_MANDELBROT = "/tmp/async_tiled-mandelbrot.png";
+constexpr const char * const OUTPUT_PATH_PALETTE = "/tmp/async_tiled-palette.png";
 
 template<typename PixelType>
 Tile2D& ClearTile2D(const TileSpec& spec, Tile2D& tile, const PixelType color) {
@@ -58,21 +68,20 @@ Tile2D& ClearRGBA8888Tile2D(const TileSpec& spec, Tile2D& tile, const RGBA color
 }
 
 /** Do a tiled clear, using the owner form of tiles. */
-void clearAsyncOwned(const RGBA clearColor, const unsigned int width, const Dims2U tileGridDims, const TileSpec &spec,
-                     Framebuffer &framebuffer)
+void clearAsyncOwned(const RGBA clearColor, const Dims2U tileGridDims, const TileSpec &spec, Framebuffer &framebuffer)
 {
     // Generate a bunch of cleared tiles:
     vector<OwningTile2D<RGBA>> tiles;
     vector<future<Tile2D&>> futureTiles = LaunchOwningTiles(spec, tileGridDims, tiles, ClearRGBA8888Tile2D, clearColor);
 
     // Copy the pixels out of the simple tiles as they become available from the asynchronous workers:
-    for_each(futureTiles.begin(), futureTiles.end(), [&spec, &framebuffer, width](auto& futureTile)->void
+    for_each(futureTiles.begin(), futureTiles.end(), [&spec, &framebuffer](auto& futureTile)->void
     {
         const Tile2D& tile = futureTile.get();
-        RGBA* outScanline = &framebuffer[tile.y * spec.h * width + tile.x * spec.w];
         const RGBA* inScanline = (RGBA*) tile.pixels;
         for(unsigned y = 0; y < spec.h; ++y)
         {
+            RGBA* const outScanline = framebuffer.row(tile.y * spec.h + y) + tile.x * spec.w;
             for(unsigned x = 0; x < spec.w; ++x)
             {
                 outScanline[x] =
@@ -80,7 +89,6 @@ void clearAsyncOwned(const RGBA clearColor, const unsigned int width, const Dims
                 // x & 1u ? inScanline[x] : RGBA{255, 0, 0, 255};
             }
             inScanline += spec.w;
-            outScanline += width;
         }
     });
 }
@@ -93,51 +101,671 @@ void clearAsyncTiled(const RGBA clearColor, const Dims2U tileGridDims, const Til
     waitAll(futureTiles);
 }
 
+/**
+ * Compare the iteration counts a row kernel produces for every pixel of an image
+ * with those of the scalar reference kernel.
+ */
+template<typename Real>
+size_t CountKernelMismatches(const MandelbrotRowFn<Real> kernel, const Real left, const Real right, const Real top, const Real bottom,
+                             const unsigned maxIters, const Dims2U imageDims)
+{
+    vector<Real> realCoords(imageDims.w);
+    vector<unsigned> expected(imageDims.w);
+    vector<unsigned> actual(imageDims.w);
+    for(unsigned x = 0; x < imageDims.w; ++x)
+    {
+        realCoords[x] = left + (right - left) / imageDims.w * x;
+    }
+    size_t mismatches = 0;
+    for(unsigned y = 0; y < imageDims.h; ++y)
+    {
+        const Real j = top + (bottom - top) / imageDims.h * y;
+        mandelbrotRowScalar(&realCoords[0], j, imageDims.w, maxIters, &expected[0], nullptr);
+        kernel(&realCoords[0], j, imageDims.w, maxIters, &actual[0], nullptr);
+        mismatches += imageDims.w - size_t(inner_product(expected.begin(), expected.end(), actual.begin(), size_t(0), plus<size_t>(), equal_to<unsigned>()));
+    }
+    return mismatches;
+}
+
+/** Count the pixels which differ between two framebuffers of the same size. */
+size_t CountPixelMismatches(const Framebuffer& lhs, const Framebuffer& rhs)
+{
+    assert(lhs.width() == rhs.width() && lhs.height() == rhs.height());
+    size_t mismatches = 0;
+    for(unsigned y = 0; y < lhs.height(); ++y)
+    {
+        const RGBA* const lhsRow = lhs.row(y);
+        const RGBA* const rhsRow = rhs.row(y);
+        for(unsigned x = 0; x < lhs.width(); ++x)
+        {
+            mismatches += !(lhsRow[x] == rhsRow[x]);
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * Time a chain of z = z^2 + c on fixed-point numbers, the core of iterating a
+ * reference orbit, to show how the cost of a square grows with the limb count.
+ */
+template<unsigned Limbs>
+void TimeFixedPointSquares()
+{
+    const unsigned squares = 100000;
+    // A real c inside the set gives an orbit which bounces around without escaping:
+    const FixedPoint<Limbs> c(-1.9);
+    FixedPoint<Limbs> z(0);
+    const auto start = chrono::steady_clock::now();
+    for(unsigned i = 0; i < squares; ++i)
+    {
+        z = z * z + c;
+    }
+    const double nanos = double(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    cerr << Limbs << " limb fixed-point: " << nanos / squares << " ns per square, "
+         << nanos / (squares * 0.5 * Limbs * (Limbs + 1)) << " ns per limb product (z = " << double(z) << ")" << endl;
+}
+
 int main() {
     cerr << "Future Ray, the ray tracer that uses C++ 11 Futures!" << endl;
+    cerr << "Tile pool workers: " << TilePool().size() << endl;
     const RGBA clearColor {192, 224, 255, 255}; //< Light blue.
     constexpr unsigned width = 2048;
     constexpr unsigned height = 1536;
-    constexpr unsigned cachelineLength = 128u; // Should pull this from OS.
-    constexpr unsigned widthInBytesRoundedToCachelines = RoundUpToCacheline(width*sizeof(RGBA), cachelineLength);
-    constexpr unsigned paddedWidth = widthInBytesRoundedToCachelines / sizeof(RGBA); // Is this robust to odd sized pixels like RGB888?
     constexpr Dims2U tileDims = {32, 32};
     constexpr Dims2U tileGridDims = {width / tileDims.w, height / tileDims.h};
     assert((width % tileDims.w == 0u) && (height % tileDims.h == 0u));
 
-    Framebuffer framebuffer(paddedWidth*height);
-    assert(framebuffer.size() % (tileDims.w * tileDims.h) == 0);
+    Framebuffer framebuffer({width, height});
     std::vector <Tile2D> tiles;
 
-    //const TileSpec spec = {TileFormat::RGBA8888, tileDims.w, tileDims.h, tileDims.w * sizeof(RGBA) };
-    //clearAsyncOwned(clearColor, width, tileGridDims, spec, framebuffer);
-    const TileSpec spec = {TileFormat::RGBA8888, tileDims.w, tileDims.h, width * sizeof(RGBA) };
+    const TileSpec spec = framebuffer.tileSpec(tileDims);
     clearAsyncTiled(clearColor, tileGridDims, spec, framebuffer);
 
     // This check that the clear worked will give a false negative if the output
     // of some debug pixels in ClearTile() is enabled:
     unsigned pixelCounts[2] = {0, 0};
-    for(auto pixel : framebuffer)
+    for(unsigned y = 0; y < height; ++y)
     {
-        pixelCounts[clearColor == pixel] += 1u;
+        for(unsigned x = 0; x < width; ++x)
+        {
+            pixelCounts[clearColor == framebuffer.row(y)[x]] += 1u;
+        }
     }
     cerr << "Cleared pixel count: " << pixelCounts[1] << endl;
     cerr << "Missed pixel count:   " << pixelCounts[0] << endl;
 
     cerr << "Saving image as PNG at \"" << OUTPUT_PATH_CLEAR << "\" ... ";
-    int pngResult = stbi_write_png(OUTPUT_PATH_CLEAR, paddedWidth, height, 4, &framebuffer[0], widthInBytesRoundedToCachelines);
+    int pngResult = stbi_write_png(OUTPUT_PATH_CLEAR, width, height, 4, framebuffer.data(), framebuffer.stride());
     cerr << "PNG write result: " << pngResult << endl;
 
+    // Owning tiles take their pixels from a pool which should stop growing after the first launch:
+    {
+        const TileSpec ownedSpec = {TileFormat::RGBA8888, tileDims.w, tileDims.h, tileDims.w * sizeof(RGBA)};
+        Framebuffer ownedFramebuffer({width, height});
+        for(const char* const pass : {"cold", "warm"})
+        {
+            const auto start = chrono::steady_clock::now();
+            clearAsyncOwned(clearColor, tileGridDims, ownedSpec, ownedFramebuffer);
+            const auto micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            const TileBlockPool::Stats pool = TileBlockPool::forBlockSize(tileDims.w * tileDims.h * sizeof(RGBA)).stats();
+            cerr << "Owned tile clear (" << pass << " pool): " << micros << " us, pool blocks: " << pool.capacity
+                 << ", in use: " << pool.inUse << ", high water: " << pool.highWater << ", tiles created/destroyed: "
+                 << OwningTile2D<RGBA>::created << "/" << OwningTile2D<RGBA>::destroyed << endl;
+        }
+        // More block sizes than there are per-thread caches should fall back to uncached pools:
+        size_t leftInUse = 0;
+        for(unsigned i = 0; i < 2 * TileBlockPool::MAX_POOLS; ++i)
+        {
+            TileBlockPool& pool = TileBlockPool::forBlockSize((i + 100) * TileBlockPool::ALIGNMENT);
+            std::vector<void*> blocks;
+            for(unsigned j = 0; j < 3 * TileBlockPool::CACHE_BATCH; ++j)
+            {
+                blocks.push_back(pool.allocate());
+            }
+            for(void* const block : blocks)
+            {
+                pool.deallocate(block);
+            }
+            leftInUse += pool.stats().inUse;
+        }
+        cerr << "Pools of " << 2 * TileBlockPool::MAX_POOLS << " extra block sizes: " << leftInUse << " blocks left in use." << endl;
+    }
+
     cerr << "Launching " << tileGridDims.w << " * " << tileGridDims.h << " (" << tileGridDims.w * tileGridDims.h << ") tiles computing mandelbrot set...";
-    std::atomic<uint16_t> transaction(0);
-    auto futureTiles = mandelbrotAsyncTiled(-2, 1, 1.5001f, -1.4999f, 32, 0, transaction, tileGridDims, spec, tiles, framebuffer);
-    waitAll(futureTiles);
+    IterationBuffer iterations({width, height}, false);
+    const PaletteLut grey32(greyPalette(32), 32);
+    const PaletteLut grey256(greyPalette(256), 256);
+    TileStream finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 32, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey32);
+    finishedTiles.waitAll();
     cerr << "completed." << endl;
 
+    // The grey palette should colour the counts exactly as the kernels used to:
+    size_t greyMismatches = 0;
+    for(unsigned y = 0; y < height; ++y)
+    {
+        for(unsigned x = 0; x < width; ++x)
+        {
+            const uint8_t grey = uint8_t(255.0f / 32 * (32 - iterations.counts[y * width + x]));
+            greyMismatches += !(framebuffer.row(y)[x] == RGBA{grey, grey, grey, 255});
+        }
+    }
+    cerr << "Grey palette pixels differing from direct colouring: " << greyMismatches << endl;
+
     cerr << "Saving image as PNG at \"" << OUTPUT_PATH_MANDELBROT << "\" ... ";
-    pngResult = stbi_write_png(OUTPUT_PATH_MANDELBROT, paddedWidth, height, 4, &framebuffer[0], widthInBytesRoundedToCachelines);
+    pngResult = stbi_write_png(OUTPUT_PATH_MANDELBROT, width, height, 4, framebuffer.data(), framebuffer.stride());
     cerr << "PNG write result: " << pngResult << endl;
 
+    // Every SIMD kernel the CPU can run must match the scalar reference bit for bit:
+    const SimdLevel cpuSimd = DetectSimdLevel();
+    cerr << "CPU SIMD level: " << simdLevelName(cpuSimd) << endl;
+    // The interior checks can only differ from it on the boundaries of the cardioid and bulb:
+    for(unsigned level = unsigned(SimdLevel::Scalar); level <= unsigned(cpuSimd); ++level)
+    {
+        for(const bool interiorChecks : {false, true})
+        {
+            const SimdLevel simd = SimdLevel(level);
+            const char* const variant = interiorChecks ? " with interior checks" : "";
+            auto start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256, mandelbrotRowKernel<float>(simd, interiorChecks));
+            finishedTiles.waitAll();
+            auto millis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            cerr << simdLevelName(simd) << " float kernel" << variant << ", 256 iterations: " << millis << " ms, pixels differing from scalar: "
+                 << CountKernelMismatches(mandelbrotRowKernel<float>(simd, interiorChecks), -2.0f, 1.0f, 1.5001f, -1.4999f, 256, {width, height}) << endl;
+
+            start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-2.0, 1.0, 1.5001, -1.4999, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256, mandelbrotRowKernel<double>(simd, interiorChecks));
+            finishedTiles.waitAll();
+            millis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            cerr << simdLevelName(simd) << " double kernel" << variant << ", 256 iterations: " << millis << " ms, pixels differing from scalar: "
+                 << CountKernelMismatches(mandelbrotRowKernel<double>(simd, interiorChecks), -2.0, 1.0, 1.5001, -1.4999, 256, {width, height}) << endl;
+        }
+    }
+
+    // Subdividing tiles should skip most of the interior and flat bands without changing the image.
+    // It pays where pixels are expensive, so compare using the scalar kernel. The columns it iterates
+    // one pixel at a time are a bad fit for the vector ones:
+    for(const SimdLevel simd : {SimdLevel::Scalar, cpuSimd})
+    {
+        auto start = chrono::steady_clock::now();
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256, mandelbrotRowKernel<float>(simd));
+        finishedTiles.waitAll();
+        const auto sampledMillis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        const Framebuffer sampled = framebuffer;
+        SubdivisionStats subdivisionStats;
+        start = chrono::steady_clock::now();
+        finishedTiles = mandelbrotSubdividedAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256, &subdivisionStats, mandelbrotRowKernel<float>(simd));
+        finishedTiles.waitAll();
+        const auto millis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        const size_t subdivisionMismatches = CountPixelMismatches(framebuffer, sampled);
+        cerr << "Subdivided tiles with the " << simdLevelName(simd) << " kernel, 256 iterations: " << millis << " ms against " << sampledMillis << " ms, "
+             << subdivisionStats.skippedFraction() * 100.0 << "% of pixels skipped, " << subdivisionMismatches << " pixels differing from sampling every one." << endl;
+    }
+
+    // Tiles near the focus should be ready long before a row-by-row launch gets to them:
+    {
+        const unsigned centreTile = tileGridDims.h / 2 * tileGridDims.w + tileGridDims.w / 2;
+        const unsigned cornerTile = tileGridDims.w * tileGridDims.h - 1;
+        auto timeTile = [&](const std::shared_ptr<TileSchedule>& schedule, const unsigned watched, const char* const description)
+        {
+            const auto start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                               iterations, grey256, MandelbrotRow<float>(), schedule);
+            if(schedule && watched == cornerTile)
+            {
+                // As the GUI does when a finger comes down while tiles are in flight:
+                schedule->setFocus({float(width), float(height)});
+            }
+            while(const Tile2D* const tile = finishedTiles.pop())
+            {
+                if(tile->y * tileGridDims.w + tile->x == watched)
+                {
+                    break;
+                }
+            }
+            const auto watchedMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            finishedTiles.waitAll();
+            const auto allMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            cerr << description << ": " << watchedMicros / 1000.0 << " ms of " << allMicros / 1000.0 << " ms" << endl;
+        };
+        timeTile(nullptr, centreTile, "Centre tile ready, row-major launch");
+        const auto schedule = std::make_shared<TileSchedule>(Point2F{width * 0.5f, height * 0.5f});
+        timeTile(schedule, centreTile, "Centre tile ready, focused on the centre");
+        timeTile(schedule, cornerTile, "Corner tile ready, refocused on it after launch");
+    }
+
+    // Cancelling a launch should drop its queued tiles rather than leaving them to run:
+    for(const bool prioritised : {false, true})
+    {
+        const auto cancellation = std::make_shared<CancellationToken>();
+        const auto schedule = prioritised ? std::make_shared<TileSchedule>(Point2F{width * 0.5f, height * 0.5f}) : nullptr;
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, cancellation, tileGridDims, spec, tiles, framebuffer,
+                                           iterations, grey256, MandelbrotRow<float>(), schedule);
+        std::this_thread::sleep_for(chrono::milliseconds(5));
+        const size_t queued = schedule ? schedule->size() : 0;
+        const auto start = chrono::steady_clock::now();
+        cancellation->cancel();
+        cancellation->waitQuiesced();
+        const auto quiescedMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        finishedTiles.waitAll();
+        const auto drainedMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        cerr << "Cancelled " << (prioritised ? "prioritised" : "row-major") << " launch after 5 ms: " << queued << " queued tiles dropped, quiesced in "
+             << quiescedMicros / 1000.0 << " ms, stream drained in " << drainedMicros / 1000.0 << " ms" << endl;
+    }
+
+    // Tiles flipped into a staging ring by several threads at once should come out whole
+    // however the uploader's releases interleave with them:
+    {
+        StagingRing staging(spec.w * spec.h * sizeof(RGBA), 64);
+        BoundedMpscQueue<std::pair<const Tile2D*, size_t>> staged(128);
+        std::atomic<size_t> next {0};
+        const unsigned producers = 4;
+        std::vector<std::thread> threads;
+        for(unsigned producer = 0; producer < producers; ++producer)
+        {
+            threads.emplace_back([&]()
+            {
+                for(size_t i = next++; i < tiles.size(); i = next++)
+                {
+                    size_t slot;
+                    while(!staging.tryAcquire(slot))
+                    {
+                        std::this_thread::yield();
+                    }
+                    copyTileFlipped(spec, tiles[i], staging.data(slot));
+                    while(!staged.tryPush({&tiles[i], slot}))
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        std::vector<RGBA> expected(spec.w * spec.h);
+        size_t mismatched = 0;
+        for(size_t uploaded = 0; uploaded < tiles.size(); ++uploaded)
+        {
+            std::pair<const Tile2D*, size_t> item;
+            while(!staged.tryPop(item))
+            {
+                std::this_thread::yield();
+            }
+            copyTileFlipped(spec, *item.first, expected.data());
+            mismatched += std::memcmp(staging.data(item.second), expected.data(), expected.size() * sizeof(RGBA)) != 0;
+            staging.release(item.second);
+        }
+        for(std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        cerr << "Staging ring: " << tiles.size() << " tiles through " << staging.slots() << " slots from " << producers << " threads, "
+             << mismatched << " tiles mismatched, " << staging.inUse() << " slots left in use." << endl;
+    }
+
+    // Rendering tiles bottom-up should give each the rows a texture upload wants with a
+    // straight copy, where a top-down render needs flipping:
+    {
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256);
+        finishedTiles.waitAll();
+        Framebuffer bottomUp({width, height});
+        std::vector<Tile2D> bottomUpTiles;
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, bottomUp.tileSpec(tileDims, RowOrder::BottomUp),
+                                           bottomUpTiles, bottomUp, iterations, grey256);
+        finishedTiles.waitAll();
+        const TileSpec bottomUpSpec = bottomUp.tileSpec(tileDims, RowOrder::BottomUp);
+        std::vector<RGBA> flipped(spec.w * spec.h);
+        std::vector<RGBA> straight(spec.w * spec.h);
+        size_t mismatched = 0;
+        long long micros[2] = {0, 0};
+        for(size_t i = 0; i < tiles.size(); ++i)
+        {
+            auto start = chrono::steady_clock::now();
+            copyTileFlipped(spec, tiles[i], flipped.data());
+            micros[0] += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            start = chrono::steady_clock::now();
+            copyTile(bottomUpSpec, bottomUpTiles[i], straight.data());
+            micros[1] += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            mismatched += std::memcmp(flipped.data(), straight.data(), flipped.size() * sizeof(RGBA)) != 0;
+        }
+        cerr << "Bottom-up tiles: " << mismatched << " of " << tiles.size() << " differing from flipping top-down ones, staged in "
+             << micros[1] / 1000.0 << " ms against " << micros[0] / 1000.0 << " ms to flip." << endl;
+    }
+
+    // Tiles finished together should be staged in a few rectangles, to upload with a call each
+    // and no further copying, with each rectangle's rows the same as the framebuffer's under it:
+    {
+        Framebuffer bottomUp({width, height});
+        const TileSpec bottomUpSpec = bottomUp.tileSpec(tileDims, RowOrder::BottomUp);
+        std::vector<Tile2D> bottomUpTiles;
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, bottomUpSpec,
+                                           bottomUpTiles, bottomUp, iterations, grey256);
+        StagingRing staging(bottomUpSpec.w * bottomUpSpec.h * sizeof(RGBA), 1024);
+        auto tileOf = [](const Tile2D* tile) -> const Tile2D& { return *tile; };
+        std::vector<Tile2D*> batch;
+        std::vector<TileRun> runs;
+        size_t batches = 0, calls = 0, mismatchedRows = 0, failedAcquires = 0;
+        while(Tile2D* const firstTile = finishedTiles.pop())
+        {
+            // Take what finishes over a 60 Hz frame, as the GUI thread would:
+            batch.assign(1, firstTile);
+            this_thread::sleep_for(chrono::microseconds(16667));
+            finishedTiles.drain(batch);
+            ++batches;
+            std::sort(batch.begin(), batch.end(), [](const Tile2D* a, const Tile2D* b) { return a->y != b->y ? a->y < b->y : a->x < b->x; });
+            coalesceTiles(batch.begin(), batch.end(), tileOf, tileGridDims.w, staging.maxRun(), runs);
+            calls += runs.size();
+            for(const TileRun& run : runs)
+            {
+                // Every run is released before the next is taken, so this should never fail:
+                StagingRing::Run staged {};
+                if(!staging.tryAcquireRun(size_t(run.w) * run.h, staged))
+                {
+                    ++failedAcquires;
+                    continue;
+                }
+                packTileRun(bottomUpSpec, run, [&](const size_t i) -> const Tile2D& { return *batch[run.first + i]; }, staging.data(staged.slot));
+                const uint8_t* const packed = staging.data(staged.slot);
+                const size_t rowBytes = size_t(run.w) * bottomUpSpec.w * sizeof(RGBA);
+                for(unsigned y = 0; y < unsigned(run.h) * bottomUpSpec.h; ++y)
+                {
+                    mismatchedRows += std::memcmp(packed + y * rowBytes, bottomUp.row(run.y * bottomUpSpec.h + y) + run.x * bottomUpSpec.w, rowBytes) != 0;
+                }
+                staging.release(staged);
+            }
+        }
+        // All at once, as a frame which finds every tile of a level ready would:
+        std::vector<Tile2D*> allTiles;
+        for(Tile2D& tile : bottomUpTiles)
+        {
+            allTiles.push_back(&tile);
+        }
+        coalesceTiles(allTiles.begin(), allTiles.end(), tileOf, tileGridDims.w, staging.maxRun(), runs);
+        cerr << "Coalesced uploads: " << tiles.size() << " tiles in " << calls << " calls over " << batches << " frames, "
+             << runs.size() << " calls for the whole grid through a " << staging.slots() << " slot ring, "
+             << mismatchedRows << " rows differing from the framebuffer, " << failedAcquires << " runs not staged, "
+             << staging.inUse() << " slots left in use." << endl;
+    }
+
+    // Going back to a view already seen should copy its tiles out of the cache instead of iterating them:
+    {
+        TileCache<RGBA> cache(64u << 20u);
+        const TilePrefill prefill = cachedTiles(cache, {0, 0, 0});
+        Framebuffer uncached;
+        long long micros[2];
+        for(unsigned pass = 0; pass < 2; ++pass)
+        {
+            const auto start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                               iterations, grey256, MandelbrotRow<float>(), nullptr, prefill);
+            while(const Tile2D* const tile = finishedTiles.pop())
+            {
+                cache.store({0, tile->x, tile->y}, spec, *tile);
+            }
+            micros[pass] = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            if(pass == 0)
+            {
+                uncached = framebuffer;
+            }
+        }
+        const TileCache<RGBA>::Stats stats = cache.stats();
+        cerr << "Cached re-render: " << micros[1] / 1000.0 << " ms against " << micros[0] / 1000.0 << " ms, " << stats.hits << " hits, "
+             << stats.misses << " misses, " << stats.bytes / 1024 << " KiB cached, "
+             << CountPixelMismatches(framebuffer, uncached) << " pixels differing from iterating." << endl;
+    }
+
+    // A store opened again as if after a restart should bring a view back without iterating it,
+    // dropping any tile whose pixels were torn:
+    {
+        const std::string storePath = "async_tiled_demo.tiles";
+        std::remove(storePath.c_str());
+        const uint64_t params = renderParamsHash(256, grey256);
+        Framebuffer iterated;
+        for(unsigned session = 0; session < 3; ++session)
+        {
+            if(session == 2)
+            {
+                // Flip a byte in the pixels of the first record:
+                std::fstream file(storePath, std::ios::in | std::ios::out | std::ios::binary);
+                file.seekg(2 * CACHELINE_LENGTH + 100);
+                const char byte = char(file.get() ^ 0x5A);
+                file.seekp(2 * CACHELINE_LENGTH + 100);
+                file.put(byte);
+            }
+            const auto start = chrono::steady_clock::now();
+            TileStore<RGBA> store(storePath, 64u << 20u);
+            finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                               iterations, grey256, MandelbrotRow<float>(), nullptr, storedTiles(store, {0, 0, 0}, params));
+            while(const Tile2D* const tile = finishedTiles.pop())
+            {
+                store.store({0, tile->x, tile->y}, params, spec, *tile);
+            }
+            const auto micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            if(session == 0)
+            {
+                iterated = framebuffer;
+            }
+            const TileStore<RGBA>::Stats stats = store.stats();
+            cerr << "Tile store session " << session << ": " << micros / 1000.0 << " ms, " << stats.hits << " hits, " << stats.corrupt << " torn, "
+                 << stats.bytesUsed / 1024 << " KiB used, " << CountPixelMismatches(framebuffer, iterated) << " pixels differing from iterating." << endl;
+        }
+        // Storing more than fits should compact the log rather than fail:
+        {
+            TileStore<RGBA> store(storePath, 1u << 20u);
+            const TilePrefill prefill = storedTiles(store, {0, 0, 0}, params);
+            for(unsigned pass = 0; pass < 2; ++pass)
+            {
+                finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                                   iterations, grey256, MandelbrotRow<float>(), nullptr, prefill);
+                while(const Tile2D* const tile = finishedTiles.pop())
+                {
+                    store.store({0, tile->x, tile->y}, params, spec, *tile);
+                }
+            }
+            const TileStore<RGBA>::Stats stats = store.stats();
+            cerr << "Tile store capped at 1 MiB: " << stats.compactions << " compactions, " << stats.tiles << " tiles kept, "
+                 << CountPixelMismatches(framebuffer, iterated) << " pixels differing from iterating." << endl;
+        }
+        // A store of one format shouldn't open as another of the same size:
+        std::remove(storePath.c_str());
+        {
+            PaddedFramebuffer<RGB565> colours(tileDims);
+            const TileSpec colourSpec = colours.tileSpec(tileDims);
+            Tile2D colourTile(colours.data(), 0, 0);
+            TileStore<RGB565>(storePath, 1u << 20u).store({0, 0, 0}, params, colourSpec, colourTile);
+        }
+        cerr << "Tile store of RGB565 reopened as U16: " << TileStore<U16>(storePath, 1u << 20u).stats().tiles << " tiles kept." << endl;
+        std::remove(storePath.c_str());
+    }
+
+    // The smaller formats should hold the same picture in a half or a quarter of the memory:
+    {
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer, iterations, grey256);
+        finishedTiles.waitAll();
+        auto renderCompact = [&](auto& compact, const char* const name, auto convert)
+        {
+            const auto start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, compact.tileSpec(tileDims), tiles, compact, iterations, grey256);
+            finishedTiles.waitAll();
+            const auto micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            size_t differing = 0;
+            for(unsigned y = 0; y < height; ++y)
+            {
+                for(unsigned x = 0; x < width; ++x)
+                {
+                    differing += !(compact.row(y)[x] == convert(framebuffer.row(y)[x], iterations.counts[y * width + x]));
+                }
+            }
+            cerr << name << " framebuffer: " << compact.bytes() / 1024 << " KiB against " << framebuffer.bytes() / 1024 << " KiB for RGBA8888, "
+                 << micros / 1000.0 << " ms, " << differing << " pixels differing from converting the RGBA8888 render." << endl;
+        };
+        PaddedFramebuffer<I8> grey({width, height});
+        renderCompact(grey, "I8", [](const RGBA colour, uint32_t) { return I8(colour); });
+        PaddedFramebuffer<RGB565> colour565({width, height});
+        renderCompact(colour565, "RGB565", [](const RGBA colour, uint32_t) { return RGB565(colour); });
+        PaddedFramebuffer<U16> counts({width, height});
+        renderCompact(counts, "U16", [](RGBA, const uint32_t count) { return U16(uint16_t(std::min(count, 65535u))); });
+    }
+
+    // Zooming in 2x onto the pixel lattice of a render should only iterate the three quarters of pixels it lacks.
+    // Spacings are powers of two so both renders put their shared pixels at the same c:
+    {
+        IterationBuffer coarseIterations({width, height}, false);
+        finishedTiles = mandelbrotAsyncTiled(-2.5, 1.5, 1.5, -1.5, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                           coarseIterations, grey256, MandelbrotRow<double>());
+        finishedTiles.waitAll();
+        CoarseSamples seed;
+        seed.iterations = &coarseIterations;
+        seed.offsetX = width / 4;
+        seed.offsetY = height / 4;
+        Framebuffer unseeded;
+        long long micros[2];
+        for(unsigned pass = 0; pass < 2; ++pass)
+        {
+            const auto start = chrono::steady_clock::now();
+            finishedTiles = mandelbrotAsyncTiled(-1.5, 0.5, 0.75, -0.75, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                               iterations, grey256, MandelbrotRow<double>(), nullptr, nullptr,
+                                               pass == 0 ? CoarseSamples() : seed);
+            finishedTiles.waitAll();
+            micros[pass] = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+            if(pass == 0)
+            {
+                unseeded = framebuffer;
+            }
+        }
+        cerr << "2x zoom in seeded from the level above: " << micros[1] / 1000.0 << " ms against " << micros[0] / 1000.0 << " ms, "
+             << CountPixelMismatches(framebuffer, unseeded) << " pixels differing from iterating them all." << endl;
+    }
+
+    // Recolouring from kept iterations should cost a small fraction of computing them:
+    {
+        IterationBuffer smoothIterations({width, height}, true);
+        const Palette fire = gradientPalette({{0, 7, 100, 255}, {32, 107, 203, 255}, {237, 255, 255, 255}, {255, 170, 0, 255}, {0, 2, 0, 255}}, 64);
+        const PaletteLut lut(fire, 256);
+        auto start = chrono::steady_clock::now();
+        finishedTiles = mandelbrotAsyncTiled(-2.0f, 1.0f, 1.5001f, -1.4999f, 256, nullptr, tileGridDims, spec, tiles, framebuffer,
+                                           smoothIterations, lut);
+        finishedTiles.waitAll();
+        const auto computeMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        const unsigned cycles = 16;
+        start = chrono::steady_clock::now();
+        for(unsigned offset = 1; offset <= cycles; ++offset)
+        {
+            const PaletteLut cycled(fire, 256, offset);
+            finishedTiles = paletteAsyncTiled(smoothIterations, cycled, tileGridDims, spec, tiles, framebuffer);
+            finishedTiles.waitAll();
+        }
+        const auto recolourMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / cycles;
+        cerr << "Smooth render, 256 iterations: " << computeMicros / 1000.0 << " ms, palette cycle step: " << recolourMicros / 1000.0 << " ms" << endl;
+
+        // Every palette kernel the CPU can run must match the scalar one:
+        vector<RGBA> expected(width), actual(width);
+        for(unsigned level = unsigned(SimdLevel::Scalar) + 1; level <= unsigned(cpuSimd); ++level)
+        {
+            size_t paletteMismatches = 0;
+            for(unsigned y = 0; y < height; ++y)
+            {
+                const uint32_t* const counts = &smoothIterations.counts[y * width];
+                const float* const fractions = &smoothIterations.fractions[y * width];
+                paletteRowScalar(counts, fractions, width, lut, &expected[0]);
+                paletteRowKernel(SimdLevel(level))(counts, fractions, width, lut, &actual[0]);
+                for(unsigned x = 0; x < width; ++x)
+                {
+                    paletteMismatches += !(expected[x] == actual[x]);
+                }
+            }
+            cerr << simdLevelName(SimdLevel(level)) << " palette kernel, pixels differing from scalar: " << paletteMismatches << endl;
+        }
+        cerr << "Saving image as PNG at \"" << OUTPUT_PATH_PALETTE << "\" ... ";
+        pngResult = stbi_write_png(OUTPUT_PATH_PALETTE, width, height, 4, framebuffer.data(), framebuffer.stride());
+        cerr << "PNG write result: " << pngResult << endl;
+    }
+
+    // Deeper zooms need wider types to tell neighbouring pixels apart:
+    for(double span = 3.0; span > 1e-60; span *= 1e-4)
+    {
+        const RealType type = ChooseRealType(span / width, 2.0);
+        cerr << "Real type for a " << width << " pixel wide region of width " << span << ": " << realTypeName(type);
+        if(type == RealType::FixedPoint)
+        {
+            cerr << " with " << FixedPointLimbsFor(span / width, 2.0) << " limbs";
+        }
+        cerr << endl;
+    }
+    TimeFixedPointSquares<2>();
+    TimeFixedPointSquares<3>();
+    TimeFixedPointSquares<4>();
+    TimeFixedPointSquares<6>();
+    TimeFixedPointSquares<8>();
+    TimeFixedPointSquares<12>();
+    TimeFixedPointSquares<16>();
+
+    // Keep the deep renders small as the software types are slow:
+    const double deepCentreX = -1.7497219;
+    const double deepCentreY = 0.0;
+    const double deepSpan = 1e-17;
+    const unsigned deepIters = 2000;
+    const Dims2U deepGridDims = {4, 3};
+    const Dims2U deepDims = pixelDims(spec, deepGridDims);
+    Framebuffer deepFramebuffer(deepDims);
+    Framebuffer directFramebuffer(deepDims);
+    const TileSpec deepSpec = deepFramebuffer.tileSpec(tileDims);
+    const double deepSpanY = -deepSpan * deepDims.h / deepDims.w;
+    IterationBuffer deepIterations(deepDims, false);
+    const PaletteLut deepPalette(greyPalette(deepIters), deepIters);
+
+    RealType deepType;
+    auto deepStart = chrono::steady_clock::now();
+    finishedTiles = mandelbrotAsyncTiledAutoPrecision(deepCentreX, deepCentreY, deepSpan, deepSpanY,
+                                                    deepIters, nullptr, deepGridDims, deepSpec, tiles, deepFramebuffer, deepIterations, deepPalette, &deepType);
+    finishedTiles.waitAll();
+    cerr << "Rendered " << deepDims.w << " * " << deepDims.h << " pixels of a region of width " << deepSpan << " by perturbation around a "
+         << realTypeName(deepType) << " reference in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - deepStart).count() << " ms" << endl;
+
+    // Glitch correction should leave it matching a render done entirely in double-double:
+    deepStart = chrono::steady_clock::now();
+    const DoubleDouble halfSpanX = deepSpan * 0.5, halfSpanY = deepSpanY * 0.5;
+    finishedTiles = mandelbrotAsyncTiled(DoubleDouble(deepCentreX) - halfSpanX, DoubleDouble(deepCentreX) + halfSpanX,
+                                       DoubleDouble(deepCentreY) - halfSpanY, DoubleDouble(deepCentreY) + halfSpanY,
+                                       deepIters, nullptr, deepGridDims, deepSpec, tiles, directFramebuffer, deepIterations, deepPalette);
+    finishedTiles.waitAll();
+    cerr << "Direct double-double render: " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - deepStart).count() << " ms" << endl;
+    for(const bool useBla : {false, true})
+    {
+        PerturbationStats perturbationStats;
+        deepStart = chrono::steady_clock::now();
+        finishedTiles = mandelbrotPerturbationAsyncTiled(DoubleDouble(deepCentreX), DoubleDouble(deepCentreY), deepSpan, deepSpanY,
+                                                       deepIters, nullptr, deepGridDims, deepSpec, tiles, deepFramebuffer, deepIterations, deepPalette, useBla, &perturbationStats);
+        finishedTiles.waitAll();
+        const auto deepMillis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - deepStart).count();
+        const size_t deepMismatches = CountPixelMismatches(deepFramebuffer, directFramebuffer);
+        cerr << "Perturbation" << (useBla ? " with BLA: " : ": ") << deepMillis << " ms, " << perturbationStats.glitchedPixels << " glitched pixels, "
+             << perturbationStats.secondaryReferences << " secondary references, " << perturbationStats.unresolvedPixels << " unresolved, "
+             << perturbationStats.skippedIterations << " of " << perturbationStats.totalIterations << " iterations skipped, "
+             << deepMismatches << " pixels differing from direct." << endl;
+    }
+
+    // A fixed-point reference orbit should do as well as a double-double one once it has as many bits.
+    // 4 limbs have 96 bits of fraction to double-double's 105 or so, and over 2000 iterations a couple of pixels
+    // on the real axis here lose the difference, escaping early. 5 limbs have 128 and should match:
+    const auto fixedPointReference = [&](auto centreX, auto centreY)
+    {
+        finishedTiles = mandelbrotPerturbationAsyncTiled(centreX, centreY, deepSpan, deepSpanY,
+                                                       deepIters, nullptr, deepGridDims, deepSpec, tiles, deepFramebuffer, deepIterations, deepPalette, false);
+        finishedTiles.waitAll();
+        cerr << "Perturbation around a " << decltype(centreX)::LIMBS << " limb fixed-point reference: "
+             << CountPixelMismatches(deepFramebuffer, directFramebuffer) << " pixels differing from direct." << endl;
+    };
+    fixedPointReference(FixedPoint<4>(deepCentreX), FixedPoint<4>(deepCentreY));
+    fixedPointReference(FixedPoint<5>(deepCentreX), FixedPoint<5>(deepCentreY));
+
+    // Past all the floating-point types the centre needs the full width of a Coordinate:
+    const double deeperSpan = 1e-40;
+    Coordinate deeperCentreX = Coordinate(deepCentreX) + Coordinate(1.2345e-30) + Coordinate(6.789e-45);
+    deepStart = chrono::steady_clock::now();
+    finishedTiles = mandelbrotAsyncTiledAutoPrecision(deeperCentreX, deepCentreY, deeperSpan, -deeperSpan * deepDims.h / deepDims.w,
+                                                    deepIters, nullptr, deepGridDims, deepSpec, tiles, deepFramebuffer, deepIterations, deepPalette, &deepType);
+    finishedTiles.waitAll();
+    cerr << "Rendered a region of width " << deeperSpan << " around a " << realTypeName(deepType) << " reference in "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - deepStart).count() << " ms" << endl;
+
     return 0;
 }
 
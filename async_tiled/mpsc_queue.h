@@ -0,0 +1,178 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_MPSC_QUEUE_H
+#define ASYNC_TILED_MPSC_QUEUE_H
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "cacheline.h"
+
+namespace async_tiled
+{
+
+/**
+ * A fixed-capacity queue which any number of threads can push to without
+ * locking and one thread pops from.
+ *
+ * It is a ring of cells, each with a sequence number saying whose turn it is:
+ * a producer claims the cell at the tail by bumping the tail with a CAS, fills
+ * it, then publishes it by advancing its sequence. The consumer owns the head
+ * outright and hands each cell back to the producers one lap on.
+ * Popping can also block, sleeping on a condition variable which producers
+ * only touch while the consumer is actually asleep.
+ */
+template<typename T>
+class BoundedMpscQueue
+{
+public:
+    /** @param capacity Rounded up to a power of two. */
+    explicit BoundedMpscQueue(const size_t capacity) :
+        mask_(roundUpToPowerOfTwo(capacity) - 1), cells_(mask_ + 1)
+    {
+        for(size_t i = 0; i < cells_.size(); ++i)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpscQueue(const BoundedMpscQueue&) = delete;
+    BoundedMpscQueue& operator = (const BoundedMpscQueue&) = delete;
+
+    size_t capacity() const { return cells_.size(); }
+
+    /**
+     * Add a value. Safe from any number of threads at once.
+     * @return false if the queue is full.
+     */
+    bool tryPush(const T& value)
+    {
+        size_t position = tail_.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell& cell = cells_[position & mask_];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t lap = intptr_t(sequence) - intptr_t(position);
+            if(lap == 0)
+            {
+                if(tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    break;
+                }
+            }
+            else if(lap < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        // Pairs with the fence in pop() so one side always sees the other:
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(consumerSleeping_.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(sleepLock_);
+            wake_.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * Take the oldest value if there is one. Consumer thread only.
+     * @return false if the queue is empty.
+     */
+    bool tryPop(T& out)
+    {
+        Cell& cell = cells_[head_ & mask_];
+        if(cell.sequence.load(std::memory_order_acquire) != head_ + 1)
+        {
+            return false;
+        }
+        out = cell.value;
+        cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+    /** Take the oldest value, sleeping until there is one. Consumer thread only. */
+    T pop()
+    {
+        T value;
+        while(!tryPop(value))
+        {
+            consumerSleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            {
+                std::unique_lock<std::mutex> lock(sleepLock_);
+                wake_.wait(lock, [this]() { return ready(); });
+            }
+            consumerSleeping_.store(false, std::memory_order_relaxed);
+        }
+        return value;
+    }
+
+    /**
+     * Take everything already in the queue, up to max values, without blocking.
+     * Consumer thread only.
+     * @return The number of values appended to out.
+     */
+    size_t drain(std::vector<T>& out, const size_t max = SIZE_MAX)
+    {
+        size_t drained = 0;
+        T value;
+        while(drained < max && tryPop(value))
+        {
+            out.push_back(value);
+            ++drained;
+        }
+        return drained;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t roundUpToPowerOfTwo(const size_t n)
+    {
+        size_t rounded = 1;
+        while(rounded < n)
+        {
+            rounded <<= 1u;
+        }
+        return rounded;
+    }
+
+    /** Whether the cell at the head has been published. */
+    bool ready() const
+    {
+        return cells_[head_ & mask_].sequence.load(std::memory_order_acquire) == head_ + 1;
+    }
+
+    const size_t mask_;
+    std::vector<Cell> cells_;
+    /// Producers and the consumer hammer these, so keep them on separate cachelines:
+    char padBeforeTail_[CACHELINE_LENGTH];
+    std::atomic<size_t> tail_ {0};
+    char padAfterTail_[CACHELINE_LENGTH];
+    size_t head_ = 0; // Consumer only.
+    std::atomic<bool> consumerSleeping_ {false};
+    std::mutex sleepLock_;
+    std::condition_variable wake_;
+};
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_MPSC_QUEUE_H
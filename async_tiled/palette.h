@@ -0,0 +1,321 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_PALETTE_H
+#define ASYNC_TILED_PALETTE_H
+#include "async_tiled.h"
+#include "simd_kernels.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace async_tiled
+{
+
+/**
+ * The escape-time samples of a whole framebuffer, which the fractal tile tasks
+ * write and the palette stage turns into colours. Keeping them means recolouring
+ * never has to iterate again.
+ * Tiles address it by their pixel position, the same way they do the framebuffer.
+ */
+struct IterationBuffer
+{
+    IterationBuffer() : dims{0, 0} {}
+    /**
+     * @param smooth Also keep the fractional part of each count for smooth
+     * colouring, see escapeFraction().
+     */
+    IterationBuffer(const Dims2U dims, const bool smooth) :
+        dims(dims), counts(dims.w * dims.h), fractions(smooth ? dims.w * dims.h : 0)
+    {}
+
+    bool smooth() const { return !fractions.empty(); }
+
+    /** The counts of row y of a tile. */
+    uint32_t* countRow(const TileSpec& spec, const Tile2D& tile, const unsigned y)
+    {
+        const Point2U position = pixelPosition(spec, tile);
+        assert(position.x + spec.w <= dims.w && position.y + y < dims.h);
+        return &counts[(position.y + y) * dims.w + position.x];
+    }
+    const uint32_t* countRow(const TileSpec& spec, const Tile2D& tile, const unsigned y) const
+    {
+        return const_cast<IterationBuffer*>(this)->countRow(spec, tile, y);
+    }
+    /** The fractions of row y of a tile, or null if they aren't being kept. */
+    float* fractionRow(const TileSpec& spec, const Tile2D& tile, const unsigned y)
+    {
+        if(!smooth())
+        {
+            return nullptr;
+        }
+        const Point2U position = pixelPosition(spec, tile);
+        return &fractions[(position.y + y) * dims.w + position.x];
+    }
+    const float* fractionRow(const TileSpec& spec, const Tile2D& tile, const unsigned y) const
+    {
+        return const_cast<IterationBuffer*>(this)->fractionRow(spec, tile, y);
+    }
+
+    Dims2U dims;
+    /// Iterations before escape, or maxIters for points taken to be inside the set.
+    std::vector<uint32_t> counts;
+    /// Empty unless smooth.
+    std::vector<float> fractions;
+};
+
+/**
+ * Colours cycled through by escaped points, one per iteration, and the colour of
+ * points inside the set.
+ */
+struct Palette
+{
+    std::vector<RGBA> colours;
+    RGBA interior;
+};
+
+/**
+ * White fading to black at the iteration limit: the look the kernels used to
+ * write directly.
+ */
+inline Palette greyPalette(const unsigned maxIters)
+{
+    Palette palette;
+    palette.colours.reserve(maxIters);
+    for(unsigned iter = 0; iter < maxIters; ++iter)
+    {
+        const uint8_t grey = uint8_t(255.0f / maxIters * (maxIters - iter));
+        palette.colours.push_back({grey, grey, grey, 255});
+    }
+    palette.interior = {0, 0, 0, 255};
+    return palette;
+}
+
+/**
+ * A loop through the given colours, blended linearly from each to the next.
+ * @param length Total colours in the loop. Shorter loops give more, narrower
+ * bands, i.e. more contrast between neighbouring counts.
+ */
+inline Palette gradientPalette(const std::vector<RGBA>& stops, const unsigned length, const RGBA interior = {0, 0, 0, 255})
+{
+    assert(!stops.empty() && length > 0);
+    Palette palette;
+    palette.colours.reserve(length);
+    for(unsigned i = 0; i < length; ++i)
+    {
+        const float position = float(i) * stops.size() / length;
+        const unsigned stop = unsigned(position);
+        const float t = position - stop;
+        const RGBA& a = stops[stop];
+        const RGBA& b = stops[(stop + 1) % stops.size()];
+        palette.colours.push_back({unsigned(a.r + (b.r - a.r) * t + 0.5f), unsigned(a.g + (b.g - a.g) * t + 0.5f),
+                                   unsigned(a.b + (b.b - a.b) * t + 0.5f), unsigned(a.a + (b.a - a.a) * t + 0.5f)});
+    }
+    palette.interior = interior;
+    return palette;
+}
+
+/**
+ * A palette unrolled for one iteration limit so that colouring a count is a
+ * single lookup: entry n is the colour for count n and entry maxIters the one
+ * after the last, for smooth counts to blend towards.
+ * Cycling the palette just means building a new one of these with a different
+ * offset, which is maxIters entries of work.
+ */
+struct PaletteLut
+{
+    PaletteLut(const Palette& palette, const unsigned maxIters, const unsigned offset = 0) :
+        maxIters(maxIters), interior(palette.interior), entries(maxIters + 1)
+    {
+        assert(!palette.colours.empty());
+        for(unsigned iter = 0; iter <= maxIters; ++iter)
+        {
+            entries[iter] = palette.colours[(iter + offset) % palette.colours.size()];
+        }
+    }
+
+    unsigned maxIters;
+    RGBA interior;
+    std::vector<RGBA> entries;
+};
+
+/**
+ * Signature of the palette row kernels: colour count pixels from their
+ * iteration counts and, if not null, fractions.
+ */
+using PaletteRowFn = void (*)(const uint32_t* counts, const float* fractions, unsigned count, const PaletteLut& lut, RGBA* out);
+
+/** Blend a channel of two colours in float, rounding to nearest even as the vector kernels do. */
+inline uint8_t blendChannel(const uint8_t a, const uint8_t b, const float t)
+{
+    return uint8_t(std::lrint(float(a) + (float(b) - float(a)) * t));
+}
+
+/** The reference palette kernel. */
+inline void paletteRowScalar(const uint32_t* const counts, const float* const fractions, const unsigned count, const PaletteLut& lut, RGBA* const out)
+{
+    const RGBA* const entries = &lut.entries[0];
+    for(unsigned x = 0; x < count; ++x)
+    {
+        const uint32_t iter = counts[x];
+        if(iter >= lut.maxIters)
+        {
+            out[x] = lut.interior;
+        }
+        else if(!fractions)
+        {
+            out[x] = entries[iter];
+        }
+        else
+        {
+            const RGBA& a = entries[iter];
+            const RGBA& b = entries[iter + 1];
+            const float t = fractions[x];
+            out[x] = {blendChannel(a.r, b.r, t), blendChannel(a.g, b.g, t), blendChannel(a.b, b.b, t), blendChannel(a.a, b.a, t)};
+        }
+    }
+}
+
+#if ASYNC_TILED_X86_SIMD
+
+/**
+ * Eight pixels at a time, gathering their colours from the table. Smooth
+ * blending unpacks the four channels of both colours to float lanes.
+ */
+ASYNC_TILED_TARGET("avx2")
+inline void paletteRowAVX2(const uint32_t* const counts, const float* const fractions, const unsigned count, const PaletteLut& lut, RGBA* const out)
+{
+    const int* const table = reinterpret_cast<const int*>(&lut.entries[0]);
+    uint32_t interior;
+    std::memcpy(&interior, &lut.interior, sizeof(interior));
+    const __m256i interiorV = _mm256_set1_epi32(int(interior));
+    const __m256i maxItersV = _mm256_set1_epi32(int(lut.maxIters));
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i channelMask = _mm256_set1_epi32(0xff);
+    unsigned x = 0;
+    for(; x + 8 <= count; x += 8)
+    {
+        // Clamping keeps interior lanes inside the table. They get their own colour below:
+        const __m256i iters = _mm256_min_epu32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + x)), maxItersV);
+        const __m256i inside = _mm256_cmpeq_epi32(iters, maxItersV);
+        __m256i colours = _mm256_i32gather_epi32(table, iters, 4);
+        if(fractions)
+        {
+            const __m256i next = _mm256_i32gather_epi32(table, _mm256_min_epu32(_mm256_add_epi32(iters, one), maxItersV), 4);
+            const __m256 t = _mm256_loadu_ps(fractions + x);
+            __m256i blended = _mm256_setzero_si256();
+            for(int shift = 0; shift < 32; shift += 8)
+            {
+                const __m256i shiftV = _mm256_set1_epi32(shift);
+                const __m256 a = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srlv_epi32(colours, shiftV), channelMask));
+                const __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srlv_epi32(next, shiftV), channelMask));
+                const __m256i channel = _mm256_cvtps_epi32(_mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t)));
+                blended = _mm256_or_si256(blended, _mm256_sllv_epi32(channel, shiftV));
+            }
+            colours = blended;
+        }
+        colours = _mm256_blendv_epi8(colours, interiorV, inside);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), colours);
+    }
+    paletteRowScalar(counts + x, fractions ? fractions + x : nullptr, count - x, lut, out + x);
+}
+
+#endif // ASYNC_TILED_X86_SIMD
+
+/**
+ * @return The palette kernel for the given instruction set. Only AVX2 has
+ * gathers, so that is the one vector version and CPUs with AVX-512 use it too.
+ */
+inline PaletteRowFn paletteRowKernel(const SimdLevel level)
+{
+    switch(level) {
+#if ASYNC_TILED_X86_SIMD
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return paletteRowAVX2;
+#endif
+        default: return paletteRowScalar;
+    }
+}
+
+/** The widest palette kernel this CPU runs, picked once on first use. */
+inline PaletteRowFn PaletteRow()
+{
+    static const PaletteRowFn kernel = paletteRowKernel(DetectSimdLevel());
+    return kernel;
+}
+
+/** Colour rows of a tile as RGBA, then pack them into one of the smaller colour formats. */
+template<typename PixelType>
+inline void paletteTilePacked(const TileSpec& spec, Tile2D& tile, const IterationBuffer& iterations, const PaletteLut& lut, const PaletteRowFn row)
+{
+    static thread_local std::vector<RGBA> colours;
+    colours.resize(spec.w);
+    for(unsigned y = 0; y < spec.h; ++y)
+    {
+        row(iterations.countRow(spec, tile, y), iterations.fractionRow(spec, tile, y), spec.w, lut, &colours[0]);
+        PixelType* const out = addressRow<PixelType>(spec, tile, y);
+        for(unsigned x = 0; x < spec.w; ++x)
+        {
+            out[x] = PixelType(colours[x]);
+        }
+    }
+}
+
+/**
+ * The palette stage for one tile: colour the samples under it into its pixels,
+ * in the tile's format. U16 tiles get the counts themselves and ignore the lut.
+ * Called at the end of each fractal tile task and by paletteAsyncTiled().
+ */
+inline Tile2D& paletteTile(const TileSpec& spec, Tile2D& tile, const IterationBuffer& iterations, const PaletteLut& lut,
+                           const PaletteRowFn row = PaletteRow())
+{
+    switch(spec.pixelFormat) {
+        case TileFormat::RGBA8888:
+            for(unsigned y = 0; y < spec.h; ++y)
+            {
+                row(iterations.countRow(spec, tile, y), iterations.fractionRow(spec, tile, y), spec.w, lut, addressRow<RGBA>(spec, tile, y));
+            }
+            break;
+        case TileFormat::I8:     paletteTilePacked<I8>(spec, tile, iterations, lut, row); break;
+        case TileFormat::RGB565: paletteTilePacked<RGB565>(spec, tile, iterations, lut, row); break;
+        case TileFormat::U16:
+            for(unsigned y = 0; y < spec.h; ++y)
+            {
+                const uint32_t* const counts = iterations.countRow(spec, tile, y);
+                U16* const out = addressRow<U16>(spec, tile, y);
+                for(unsigned x = 0; x < spec.w; ++x)
+                {
+                    out[x] = U16(uint16_t(std::min<uint32_t>(counts[x], 65535u)));
+                }
+            }
+            break;
+    }
+    return tile;
+}
+
+/**
+ * Recolour a whole framebuffer from the iterations of its last render, as a
+ * stage of tile tasks of its own. For palette changes, cycling and contrast.
+ * iterations and lut must outlive the tasks.
+ */
+template<typename PixelType>
+TileStream paletteAsyncTiled(
+        const IterationBuffer& iterations, const PaletteLut& lut,
+        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, PaddedFramebuffer<PixelType>& framebuffer,
+        /// If not null, tiles run nearest its focus first.
+        const std::shared_ptr<TileSchedule>& schedule = nullptr)
+{
+    return LaunchTilesStreaming(schedule, nullptr, spec, tileGridDims, framebuffer, tiles,
+        [&iterations, &lut](const TileSpec &spec, Tile2D &tile) -> Tile2D &
+    {
+        return paletteTile(spec, tile, iterations, lut);
+    });
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_PALETTE_H
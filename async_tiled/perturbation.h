@@ -0,0 +1,413 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_PERTURBATION_H
+#define ASYNC_TILED_PERTURBATION_H
+#include "async_tiled.h"
+#include "real_types.h"
+#include "palette.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace async_tiled {
+
+/**
+ * Pauldelbrot's glitch criterion: once |z| of a pixel drops below this fraction
+ * of |Z| of the reference orbit it is following, the low precision delta has lost
+ * too many bits to cancellation to be trusted.
+ */
+constexpr double GLITCH_TOLERANCE = 1e-3;
+
+/** How many extra references a tile tries before giving up on its glitched pixels. */
+constexpr unsigned MAX_SECONDARY_REFERENCES = 4;
+
+/**
+ * Relative size of the dropped d^2 term, compared to the linear ones, which a
+ * bivariate linear approximation step may ignore. Around float precision: the
+ * error this lets in is well under a pixel at the depths perturbation is used.
+ */
+constexpr double BLA_EPSILON = 1.0 / (1u << 24);
+
+/**
+ * The orbit Z_0 = 0, Z_(n+1) = Z_n^2 + C of a single point, iterated in high
+ * precision and then rounded to double for pixels to perturb around.
+ */
+struct ReferenceOrbit
+{
+    /// Real and imaginary parts of Z_n, up to Z_maxIters or the first one outside the escape radius.
+    std::vector<double> zr;
+    std::vector<double> zi;
+    /// (GLITCH_TOLERANCE * |Z_n|)^2, which |z_n|^2 of a pixel must not drop below.
+    std::vector<double> glitchMag2;
+
+    unsigned length() const { return unsigned(zr.size()); }
+};
+
+/**
+ * Iterate one point in high precision.
+ * The update is the same sequence of operations as mandelbrotRowScalar().
+ */
+template<typename HighReal>
+std::shared_ptr<ReferenceOrbit> computeReferenceOrbit(const HighReal cr, const HighReal ci, const unsigned maxIters)
+{
+    auto orbit = std::make_shared<ReferenceOrbit>();
+    orbit->zr.reserve(maxIters + 1);
+    orbit->zi.reserve(maxIters + 1);
+    orbit->glitchMag2.reserve(maxIters + 1);
+    const HighReal four(4);
+    HighReal zr(0), zi(0), zr2(0), zi2(0);
+    for(unsigned n = 0; ; ++n)
+    {
+        const double zrD = double(zr);
+        const double ziD = double(zi);
+        orbit->zr.push_back(zrD);
+        orbit->zi.push_back(ziD);
+        orbit->glitchMag2.push_back(GLITCH_TOLERANCE * GLITCH_TOLERANCE * (zrD * zrD + ziD * ziD));
+        if(n == maxIters || zr2 + zi2 >= four)
+        {
+            break;
+        }
+        zi = (zr + zr) * zi + ci;
+        zr = (zr2 - zi2) + cr;
+        zr2 = zr * zr;
+        zi2 = zi * zi;
+    }
+    return orbit;
+}
+
+/**
+ * One bivariate linear approximation step: a run of iterations of a reference
+ * orbit collapsed into d_(n+l) = A d_n + B dc, which holds while |d_n| < r.
+ */
+struct BlaStep
+{
+    double ar, ai;
+    double br, bi;
+    /// Square of the validity radius.
+    double r2;
+};
+
+/**
+ * A binary tree of BLA steps over a reference orbit, built once per view and
+ * then only read by the tiles.
+ * Level k holds steps of 2^k iterations, the i'th starting at iteration
+ * 1 + i * 2^k. Iteration 0 has no step as d_1 = dc exactly.
+ */
+struct BlaTable
+{
+    std::vector<std::vector<BlaStep>> levels;
+
+    /** The longest step which starts at iteration n, is valid for |d_n|^2 = d2 and doesn't pass maxIter. */
+    const BlaStep* lookup(const unsigned n, const double d2, const unsigned maxIter, unsigned& length) const
+    {
+        if(n == 0 || levels.empty() || n - 1 >= levels[0].size())
+        {
+            return nullptr;
+        }
+        const unsigned offset = n - 1;
+        // Merged steps are never valid further out than their first single step,
+        // so once that fails there is no point searching the tree:
+        if(d2 >= levels[0][offset].r2)
+        {
+            return nullptr;
+        }
+        for(unsigned level = unsigned(levels.size()); level-- > 0; )
+        {
+            const unsigned stepLength = 1u << level;
+            if(offset % stepLength != 0 || n + stepLength > maxIter)
+            {
+                continue;
+            }
+            const unsigned i = offset >> level;
+            if(i < levels[level].size() && d2 < levels[level][i].r2)
+            {
+                length = stepLength;
+                return &levels[level][i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * Build the BLA tree for an orbit.
+ * @param maxDc The largest |dc| of any pixel that will use the table.
+ */
+inline std::shared_ptr<BlaTable> buildBlaTable(const ReferenceOrbit& orbit, const double maxDc)
+{
+    auto table = std::make_shared<BlaTable>();
+    const unsigned length = orbit.length();
+    if(length < 3)
+    {
+        return table;
+    }
+    // Single steps: d_(n+1) = 2 Z_n d_n + 1 dc while d_n^2 is negligible against 2 Z_n d_n:
+    std::vector<BlaStep> steps;
+    steps.reserve(length - 2);
+    for(unsigned n = 1; n + 1 < length; ++n)
+    {
+        const double ar = orbit.zr[n] + orbit.zr[n];
+        const double ai = orbit.zi[n] + orbit.zi[n];
+        const double r = BLA_EPSILON * std::sqrt(ar * ar + ai * ai);
+        steps.push_back({ar, ai, 1.0, 0.0, r * r});
+    }
+    table->levels.push_back(std::move(steps));
+
+    // Merge x then y into one step: A = Ay Ax, B = Ay Bx + By, r = min(rx, (ry - |Bx| maxDc) / |Ax|):
+    while(table->levels.back().size() > 1)
+    {
+        const std::vector<BlaStep>& lower = table->levels.back();
+        std::vector<BlaStep> merged;
+        merged.reserve(lower.size() / 2);
+        for(size_t i = 0; i + 1 < lower.size(); i += 2)
+        {
+            const BlaStep& x = lower[i];
+            const BlaStep& y = lower[i + 1];
+            const double axMag = std::sqrt(x.ar * x.ar + x.ai * x.ai);
+            const double bxMag = std::sqrt(x.br * x.br + x.bi * x.bi);
+            const double ry = std::fmax(0.0, (std::sqrt(y.r2) - bxMag * maxDc) / axMag);
+            const double r = std::fmin(std::sqrt(x.r2), ry);
+            merged.push_back({
+                y.ar * x.ar - y.ai * x.ai, y.ar * x.ai + y.ai * x.ar,
+                (y.ar * x.br - y.ai * x.bi) + y.br, (y.ar * x.bi + y.ai * x.br) + y.bi,
+                r * r});
+        }
+        table->levels.push_back(std::move(merged));
+    }
+    return table;
+}
+
+/**
+ * Iterate a pixel as a delta from a reference orbit:
+ * d_(n+1) = (2 Z_n + d_n) d_n + dc, with z_n = Z_n + d_n.
+ * @param dcr, dci The offset of the pixel's c from the reference's C.
+ * @param glitched Set if the result can't be trusted, either because the
+ * Pauldelbrot criterion fired or because the reference escaped first.
+ * @param bla If not null, used to jump over runs of iterations while |d_n| is
+ * small enough for them to be linear.
+ * @param skipped Incremented by the number of iterations jumped over.
+ * @param fraction If not null, set to the smooth fraction of the count, see
+ * escapeFraction().
+ * @return The iteration count, as defined by mandelbrotRowScalar().
+ */
+inline unsigned perturbPixel(const ReferenceOrbit& orbit, const double dcr, const double dci, const unsigned maxIters, bool& glitched,
+                             const BlaTable* const bla = nullptr, unsigned* const skipped = nullptr, float* const fraction = nullptr)
+{
+    const double* const Zr = &orbit.zr[0];
+    const double* const Zi = &orbit.zi[0];
+    const double* const glitchMag2 = &orbit.glitchMag2[0];
+    const unsigned orbitLength = orbit.length();
+    // BLA steps must land on an iteration the orbit has and not past the limit:
+    const unsigned blaLimit = std::min(maxIters, orbitLength - 1);
+    glitched = false;
+    if(fraction)
+    {
+        *fraction = 0.0f;
+    }
+    double dr = 0.0, di = 0.0;
+    unsigned iter = 0;
+    while(iter < maxIters)
+    {
+        if(bla)
+        {
+            unsigned stepLength;
+            if(const BlaStep* step = bla->lookup(iter, dr * dr + di * di, blaLimit, stepLength))
+            {
+                const double ndr = (step->ar * dr - step->ai * di) + (step->br * dcr - step->bi * dci);
+                di = (step->ar * di + step->ai * dr) + (step->br * dci + step->bi * dcr);
+                dr = ndr;
+                iter += stepLength;
+                if(skipped)
+                {
+                    *skipped += stepLength;
+                }
+                continue;
+            }
+        }
+        if(iter + 1 >= orbitLength)
+        {
+            glitched = true;
+            break;
+        }
+        const double tr = (Zr[iter] + Zr[iter]) + dr;
+        const double ti = (Zi[iter] + Zi[iter]) + di;
+        const double ndr = (tr * dr - ti * di) + dcr;
+        di = (tr * di + ti * dr) + dci;
+        dr = ndr;
+        const double zr = Zr[iter + 1] + dr;
+        const double zi = Zi[iter + 1] + di;
+        const double mag2 = zr * zr + zi * zi;
+        if(mag2 >= 4.0)
+        {
+            if(fraction)
+            {
+                *fraction = escapeFraction(mag2);
+            }
+            break;
+        }
+        if(mag2 < glitchMag2[iter + 1])
+        {
+            glitched = true;
+            break;
+        }
+        ++iter;
+    }
+    return iter;
+}
+
+/** Optional counters for seeing how much glitch correction a render needed. */
+struct PerturbationStats
+{
+    std::atomic<unsigned> glitchedPixels {0};
+    std::atomic<unsigned> secondaryReferences {0};
+    std::atomic<unsigned> unresolvedPixels {0};
+    /// Iterations jumped over by BLA steps and iterations actually done, summed over all pixels.
+    std::atomic<uint64_t> skippedIterations {0};
+    std::atomic<uint64_t> totalIterations {0};
+};
+
+/**
+ * Do a mandelbrot set by perturbation, using the shared framebuffer form of tiles.
+ * One reference orbit at the centre of the region is iterated in HighReal before
+ * the tiles are launched and shared by all of them. Every pixel is then iterated
+ * in double as a delta from it. A tile with glitched pixels computes secondary
+ * references at one of them and re-renders the glitched ones against that.
+ * Tiles are coloured from iterations with palette as in mandelbrotAsyncTiled().
+ * @param spanX Width of the region. Pixel column 0 is at centreX - spanX / 2.
+ * @param spanY Height of the region. Pixel row 0 is at centreY - spanY / 2.
+ */
+template<typename HighReal, typename PixelType>
+TileStream mandelbrotPerturbationAsyncTiled(
+        const HighReal centreX, const HighReal centreY, const double spanX, const double spanY,
+        const unsigned maxIters,
+        /// When cancelled, the async operations will be abandoned. May be null.
+        const std::shared_ptr<CancellationToken>& cancellation,
+        const Dims2U tileGridDims, const TileSpec &spec, std::vector <Tile2D>& tiles, PaddedFramebuffer<PixelType>& framebuffer,
+        IterationBuffer& iterations, const PaletteLut& palette,
+        const bool useBla = true,
+        PerturbationStats* const stats = nullptr,
+        /// If not null, tiles run nearest its focus first.
+        const std::shared_ptr<TileSchedule>& schedule = nullptr,
+        /// If not null, tried on each tile first. The tiles it fills are not iterated.
+        const TilePrefill& prefill = nullptr)
+{
+    const Dims2U framebufferDims = pixelDims(spec, tileGridDims);
+    std::shared_ptr<const ReferenceOrbit> reference = computeReferenceOrbit(centreX, centreY, maxIters);
+    std::shared_ptr<const BlaTable> bla;
+    if(useBla)
+    {
+        bla = buildBlaTable(*reference, 0.5 * std::sqrt(spanX * spanX + spanY * spanY));
+    }
+
+    return LaunchTilesStreaming(schedule, cancellation, spec, tileGridDims, framebuffer, tiles,
+        [centreX, centreY, spanX, spanY, maxIters, framebufferDims, reference, bla, cancellation, &iterations, &palette, stats](const TileSpec &spec, Tile2D &tile) -> Tile2D &
+    {
+        const Point2U framebufferPosition = pixelPosition(spec, tile);
+        // Offset of a pixel from the centre of the region:
+        auto deltaCr = [&](const unsigned x) { return spanX * (double(framebufferPosition.x + x) / framebufferDims.w - 0.5); };
+        auto deltaCi = [&](const unsigned y) { return spanY * (double(framebufferPosition.y + y) / framebufferDims.h - 0.5); };
+
+        static thread_local std::vector<unsigned> glitches;
+        glitches.clear();
+        unsigned skipped = 0;
+
+        for (unsigned y = 0; y < spec.h; ++y) {
+            // Allow cancelation per scanline so we don't burn cycles if this tile becomes
+            // out of date before it is even fully generated:
+            if(isCancelled(cancellation))
+            {
+                return tile;
+            }
+            const double dci = deltaCi(y);
+            uint32_t* const counts = iterations.countRow(spec, tile, y);
+            float* const fractions = iterations.fractionRow(spec, tile, y);
+            for (unsigned x = 0; x < spec.w; ++x) {
+                bool glitched;
+                counts[x] = perturbPixel(*reference, deltaCr(x), dci, maxIters, glitched, bla.get(), &skipped, fractions ? fractions + x : nullptr);
+                if(glitched)
+                {
+                    glitches.push_back(y * spec.w + x);
+                }
+            }
+        }
+        if(stats)
+        {
+            stats->glitchedPixels += unsigned(glitches.size());
+            stats->skippedIterations += skipped;
+            for (unsigned y = 0; y < spec.h; ++y) {
+                const uint32_t* const counts = iterations.countRow(spec, tile, y);
+                for (unsigned x = 0; x < spec.w; ++x) {
+                    stats->totalIterations += counts[x];
+                }
+            }
+        }
+
+        // Re-render glitched pixels against a reference picked from among them:
+        for(unsigned attempt = 0; !glitches.empty() && attempt < MAX_SECONDARY_REFERENCES; ++attempt)
+        {
+            if(isCancelled(cancellation))
+            {
+                return tile;
+            }
+            // Take the glitched pixel nearest their centroid as the new reference:
+            double sumX = 0.0, sumY = 0.0;
+            for(const unsigned pixel : glitches)
+            {
+                sumX += pixel % spec.w;
+                sumY += pixel / spec.w;
+            }
+            const double centroidX = sumX / glitches.size();
+            const double centroidY = sumY / glitches.size();
+            unsigned secondaryPixel = glitches[0];
+            double nearest2 = 1e300;
+            for(const unsigned pixel : glitches)
+            {
+                const double dx = pixel % spec.w - centroidX;
+                const double dy = pixel / spec.w - centroidY;
+                if(dx * dx + dy * dy < nearest2)
+                {
+                    nearest2 = dx * dx + dy * dy;
+                    secondaryPixel = pixel;
+                }
+            }
+            const double secondaryDcr = deltaCr(secondaryPixel % spec.w);
+            const double secondaryDci = deltaCi(secondaryPixel / spec.w);
+            const std::shared_ptr<const ReferenceOrbit> secondary =
+                computeReferenceOrbit(centreX + HighReal(secondaryDcr), centreY + HighReal(secondaryDci), maxIters);
+            if(stats)
+            {
+                ++stats->secondaryReferences;
+            }
+
+            unsigned stillGlitched = 0;
+            for(const unsigned pixel : glitches)
+            {
+                bool glitched;
+                const unsigned x = pixel % spec.w, y = pixel / spec.w;
+                float* const fractions = iterations.fractionRow(spec, tile, y);
+                iterations.countRow(spec, tile, y)[x] = perturbPixel(*secondary, deltaCr(x) - secondaryDcr, deltaCi(y) - secondaryDci, maxIters, glitched,
+                                                                     nullptr, nullptr, fractions ? fractions + x : nullptr);
+                if(glitched)
+                {
+                    glitches[stillGlitched++] = pixel;
+                }
+            }
+            glitches.resize(stillGlitched);
+        }
+        if(stats && !glitches.empty())
+        {
+            stats->unresolvedPixels += unsigned(glitches.size());
+        }
+
+        return paletteTile(spec, tile, iterations, palette);
+    }, prefill);
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_PERTURBATION_H
@@ -0,0 +1,274 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_REAL_TYPES_H
+#define ASYNC_TILED_REAL_TYPES_H
+#include "fixed_point.h"
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+#if defined(__SIZEOF_FLOAT128__)
+#define ASYNC_TILED_HAS_FLOAT128 1
+#else
+#define ASYNC_TILED_HAS_FLOAT128 0
+#endif
+
+namespace async_tiled
+{
+
+/**
+ * An unevaluated sum of two doubles, giving about 106 bits of significand using
+ * only hardware double arithmetic.
+ * Uses Dekker's splitting rather than FMA for the exact products so it is only
+ * correct when the compiler is not contracting multiplies and adds
+ * (-ffp-contract=off).
+ */
+struct DoubleDouble
+{
+    DoubleDouble() : hi(0.0), lo(0.0) {}
+    DoubleDouble(const double d) : hi(d), lo(0.0) {}
+    DoubleDouble(const double hi, const double lo) : hi(hi), lo(lo) {}
+
+    explicit operator double() const { return hi + lo; }
+
+    /** s + err == a + b exactly. */
+    static DoubleDouble twoSum(const double a, const double b)
+    {
+        const double s = a + b;
+        const double bb = s - a;
+        return {s, (a - (s - bb)) + (b - bb)};
+    }
+    /** As twoSum() but requires |a| >= |b|. */
+    static DoubleDouble quickTwoSum(const double a, const double b)
+    {
+        const double s = a + b;
+        return {s, b - (s - a)};
+    }
+    /** Split into two halves of 26 bits which can be multiplied without rounding. */
+    static void split(const double a, double& hi, double& lo)
+    {
+        const double t = 134217729.0 * a; // 2^27 + 1
+        hi = t - (t - a);
+        lo = a - hi;
+    }
+    /** p + err == a * b exactly. */
+    static DoubleDouble twoProd(const double a, const double b)
+    {
+        const double p = a * b;
+        double ah, al, bh, bl;
+        split(a, ah, al);
+        split(b, bh, bl);
+        return {p, ((ah * bh - p) + ah * bl + al * bh) + al * bl};
+    }
+
+    double hi;
+    double lo;
+};
+
+inline DoubleDouble operator + (const DoubleDouble& a, const DoubleDouble& b)
+{
+    DoubleDouble s = DoubleDouble::twoSum(a.hi, b.hi);
+    const DoubleDouble t = DoubleDouble::twoSum(a.lo, b.lo);
+    s.lo += t.hi;
+    s = DoubleDouble::quickTwoSum(s.hi, s.lo);
+    s.lo += t.lo;
+    return DoubleDouble::quickTwoSum(s.hi, s.lo);
+}
+
+inline DoubleDouble operator - (const DoubleDouble& a)
+{
+    return {-a.hi, -a.lo};
+}
+
+inline DoubleDouble operator - (const DoubleDouble& a, const DoubleDouble& b)
+{
+    return a + -b;
+}
+
+inline DoubleDouble operator * (const DoubleDouble& a, const DoubleDouble& b)
+{
+    DoubleDouble p = DoubleDouble::twoProd(a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return DoubleDouble::quickTwoSum(p.hi, p.lo);
+}
+
+/** Long division by three successive double quotients. */
+inline DoubleDouble operator / (const DoubleDouble& a, const DoubleDouble& b)
+{
+    const double q1 = a.hi / b.hi;
+    DoubleDouble r = a - b * DoubleDouble(q1);
+    const double q2 = r.hi / b.hi;
+    r = r - b * DoubleDouble(q2);
+    const double q3 = r.hi / b.hi;
+    return DoubleDouble::quickTwoSum(q1, q2) + DoubleDouble(q3);
+}
+
+inline bool operator < (const DoubleDouble& a, const DoubleDouble& b)
+{
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+inline bool operator > (const DoubleDouble& a, const DoubleDouble& b) { return b < a; }
+inline bool operator >= (const DoubleDouble& a, const DoubleDouble& b) { return !(a < b); }
+inline bool operator <= (const DoubleDouble& a, const DoubleDouble& b) { return !(b < a); }
+inline bool operator == (const DoubleDouble& a, const DoubleDouble& b) { return a.hi == b.hi && a.lo == b.lo; }
+inline bool operator != (const DoubleDouble& a, const DoubleDouble& b) { return !(a == b); }
+
+/**
+ * The real number types the fractal kernels can be instantiated with, in order
+ * of increasing cost per operation.
+ */
+enum class RealType
+{
+    Float = 0,
+    Double,
+    LongDouble,
+    DoubleDouble,
+#if ASYNC_TILED_HAS_FLOAT128
+    Float128,
+#endif
+    /// Any number of limbs up to COORDINATE_LIMBS, see FixedPointLimbsFor().
+    FixedPoint,
+    Count
+};
+
+/** Name and precision of each type the kernels can be instantiated with. */
+template<typename Real>
+struct RealTraits;
+
+template<>
+struct RealTraits<float>
+{
+    static constexpr RealType type = RealType::Float;
+    static const char* name() { return "float"; }
+    static double epsilon() { return std::numeric_limits<float>::epsilon(); }
+};
+template<>
+struct RealTraits<double>
+{
+    static constexpr RealType type = RealType::Double;
+    static const char* name() { return "double"; }
+    static double epsilon() { return std::numeric_limits<double>::epsilon(); }
+};
+template<>
+struct RealTraits<long double>
+{
+    static constexpr RealType type = RealType::LongDouble;
+    static const char* name() { return "long double"; }
+    static double epsilon() { return double(std::numeric_limits<long double>::epsilon()); }
+};
+template<>
+struct RealTraits<DoubleDouble>
+{
+    static constexpr RealType type = RealType::DoubleDouble;
+    static const char* name() { return "double-double"; }
+    // Not quite the full 106 bits as the lo half rounds independently:
+    static double epsilon() { return std::ldexp(1.0, -104); }
+};
+#if ASYNC_TILED_HAS_FLOAT128
+template<>
+struct RealTraits<__float128>
+{
+    static constexpr RealType type = RealType::Float128;
+    static const char* name() { return "__float128"; }
+    static double epsilon() { return std::ldexp(1.0, -112); }
+};
+#endif
+template<unsigned Limbs>
+struct RealTraits<FixedPoint<Limbs>>
+{
+    static constexpr RealType type = RealType::FixedPoint;
+    static const char* name() { return "fixed-point"; }
+    // Multiplies truncate so the last couple of bits are lost:
+    static double epsilon() { return std::ldexp(1.0, 2 - int(FixedPoint<Limbs>::FRACTION_BITS)); }
+};
+
+inline const char* realTypeName(const RealType type)
+{
+    switch(type) {
+        case RealType::Float:        return RealTraits<float>::name();
+        case RealType::Double:       return RealTraits<double>::name();
+        case RealType::LongDouble:   return RealTraits<long double>::name();
+        case RealType::DoubleDouble: return RealTraits<DoubleDouble>::name();
+#if ASYNC_TILED_HAS_FLOAT128
+        case RealType::Float128:     return RealTraits<__float128>::name();
+#endif
+        case RealType::FixedPoint:   return RealTraits<Coordinate>::name();
+        default: break;
+    }
+    return "unknown";
+}
+
+inline double realTypeEpsilon(const RealType type)
+{
+    switch(type) {
+        case RealType::Float:        return RealTraits<float>::epsilon();
+        case RealType::Double:       return RealTraits<double>::epsilon();
+        case RealType::LongDouble:   return RealTraits<long double>::epsilon();
+        case RealType::DoubleDouble: return RealTraits<DoubleDouble>::epsilon();
+#if ASYNC_TILED_HAS_FLOAT128
+        case RealType::Float128:     return RealTraits<__float128>::epsilon();
+#endif
+        case RealType::FixedPoint:   return RealTraits<Coordinate>::epsilon();
+        default: break;
+    }
+    return 0.0;
+}
+
+/**
+ * How many units in the last place, at the magnitude of the coordinates, a pixel
+ * must span before a type is trusted to tell neighbouring pixels apart once the
+ * iteration has amplified the rounding a little.
+ */
+constexpr double PRECISION_HEADROOM_ULPS = 16.0;
+
+/**
+ * Pick the cheapest type whose epsilon still resolves the spacing between pixels.
+ * @param pixelSpacing Distance in the complex plane between adjacent pixels.
+ * @param magnitude Largest absolute coordinate of the region. The orbits reach
+ * the escape radius of 2 so anything smaller than that is treated as 2.
+ * @return The most precise type available if even that one can't resolve the pixels.
+ */
+inline RealType ChooseRealType(const double pixelSpacing, const double magnitude)
+{
+    const double scale = std::fmax(std::fabs(magnitude), 2.0);
+    RealType chosen = RealType::Float;
+    for(unsigned t = 0; t < unsigned(RealType::Count); ++t)
+    {
+        const RealType type = RealType(t);
+        // Skip types like long double on platforms where it is no better than double:
+        if(realTypeEpsilon(type) >= realTypeEpsilon(chosen) && type != RealType::Float)
+        {
+            continue;
+        }
+        chosen = type;
+        if(std::fabs(pixelSpacing) > scale * realTypeEpsilon(type) * PRECISION_HEADROOM_ULPS)
+        {
+            break;
+        }
+    }
+    return chosen;
+}
+
+/**
+ * The fewest fixed-point limbs which resolve the spacing between pixels, by the
+ * same rule as ChooseRealType().
+ * @return At most COORDINATE_LIMBS, as the coordinates themselves hold no more.
+ */
+inline unsigned FixedPointLimbsFor(const double pixelSpacing, const double magnitude)
+{
+    const double scale = std::fmax(std::fabs(magnitude), 2.0);
+    unsigned limbs = 2;
+    while(limbs < COORDINATE_LIMBS &&
+          std::fabs(pixelSpacing) <= scale * std::ldexp(1.0, 2 - int(32 * (limbs - 1))) * PRECISION_HEADROOM_ULPS)
+    {
+        ++limbs;
+    }
+    return limbs;
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_REAL_TYPES_H
@@ -35,8 +35,7 @@ Dims2U TileDims(Dims2U minTile, unsigned desiredNumTiles, Dims2U frameDims, unsi
  */
 bool ClearTile(Framebuffer& framebuffer, const unsigned framebufferPaddedWidthPixels, const Dims2U tileDims, const Point2U tileCoords, RGBA color)
 {
-    RGBA* const tilecorner = &framebuffer[0] + tileCoords.y * tileDims.h * framebufferPaddedWidthPixels +
-                             tileCoords.x * tileDims.w;
+    RGBA* const tilecorner = framebuffer.row(tileCoords.y * tileDims.h) + tileCoords.x * tileDims.w;
     for(unsigned y = 0; y < tileDims.h; ++y)
     {
         RGBA* pixelRow = tilecorner + framebufferPaddedWidthPixels * y;
@@ -0,0 +1,731 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_SIMD_KERNELS_H
+#define ASYNC_TILED_SIMD_KERNELS_H
+#include <cmath>
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(_MSC_VER)) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define ASYNC_TILED_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define ASYNC_TILED_X86_SIMD 0
+#endif
+
+// Lets the wider instruction sets be used in individual functions without
+// building the whole program for a CPU that has them:
+#if ASYNC_TILED_X86_SIMD && defined(__GNUC__)
+#define ASYNC_TILED_TARGET(isa) __attribute__((target(isa)))
+#else
+#define ASYNC_TILED_TARGET(isa)
+#endif
+
+// Whether the kernels picked by default skip points they can prove are inside
+// the set. Both variants are always compiled so they can be benchmarked against
+// each other.
+#ifndef ASYNC_TILED_INTERIOR_CHECKS
+#define ASYNC_TILED_INTERIOR_CHECKS 1
+#endif
+
+namespace async_tiled
+{
+
+/** Instruction sets which Mandelbrot row kernels exist for, in order of width. */
+enum class SimdLevel
+{
+    Scalar = 0,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+inline const char* simdLevelName(const SimdLevel level)
+{
+    switch(level) {
+        case SimdLevel::Scalar: return "scalar";
+        case SimdLevel::SSE2:   return "SSE2";
+        case SimdLevel::AVX2:   return "AVX2";
+        case SimdLevel::AVX512: return "AVX-512";
+    }
+    return "unknown";
+}
+
+/**
+ * Ask the CPU (and OS, for the wide register state) which of the SIMD kernels
+ * it can run.
+ */
+inline SimdLevel DetectSimdLevel()
+{
+#if ASYNC_TILED_X86_SIMD && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    const bool ymmState = (xcr0 & 0x06) == 0x06;
+    const bool zmmState = (xcr0 & 0xe6) == 0xe6;
+    bool avx2 = false;
+    bool avx512f = false;
+    if(maxLeaf >= 7)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512f = (info[1] & (1 << 16)) != 0;
+    }
+    if(avx512f && zmmState) { return SimdLevel::AVX512; }
+    if(avx2 && ymmState)    { return SimdLevel::AVX2; }
+    if(sse2)                { return SimdLevel::SSE2; }
+    return SimdLevel::Scalar;
+#elif ASYNC_TILED_X86_SIMD
+    // The builtins check the OS has enabled the register state as well as the CPUID bits:
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) { return SimdLevel::AVX512; }
+    if(__builtin_cpu_supports("avx2"))    { return SimdLevel::AVX2; }
+    if(__builtin_cpu_supports("sse2"))    { return SimdLevel::SSE2; }
+    return SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+/**
+ * Signature of all the row kernels: iterate z = z^2 + c for each c = (cr[x], ci)
+ * with x in [0, count) and write the number of iterations before escape to
+ * itersOut[x]. If fractionsOut is not null, the escapeFraction() of each pixel
+ * is written to fractionsOut[x] as well.
+ */
+template<typename Real>
+using MandelbrotRowFn = void (*)(const Real* cr, Real ci, unsigned count, unsigned maxIters, unsigned* itersOut, float* fractionsOut);
+
+/**
+ * The fractional part of a smooth iteration count, from |z|^2 at escape:
+ * count + 1 - log2(log2(|z|)) grows continuously across the bands of whole
+ * counts, so this is 1 for a z which only just passed the escape radius of 2,
+ * falling to 0 as it lands further out. Clamped to [0, 1], and 0 for points which
+ * never escaped.
+ */
+inline float escapeFraction(const double mag2)
+{
+    if(!(mag2 >= 4.0))
+    {
+        return 0.0f;
+    }
+    const double fraction = 1.0 - std::log2(0.5 * std::log2(mag2));
+    return float(std::fmin(std::fmax(fraction, 0.0), 1.0));
+}
+
+/**
+ * Whether c lies inside the main cardioid or the period-2 bulb, the two biggest
+ * components of the set, where the iteration would only ever run to the limit.
+ * Both tests are strict so points on the boundaries still get iterated.
+ */
+template<typename Real>
+inline bool insideCardioidOrBulb(const Real cr, const Real ci)
+{
+    const Real ci2 = ci * ci;
+    const Real xq = cr - Real(0.25);
+    const Real q = xq * xq + ci2;
+    const Real xb = cr + Real(1);
+    return q * (q + xq) < Real(0.25) * ci2 || xb * xb + ci2 < Real(0.0625);
+}
+
+/**
+ * The reference kernel, for any of the types in real_types.h. Every other kernel
+ * does exactly the same sequence of IEEE operations per lane so their output is
+ * bit-identical to this.
+ * The iteration count is the number of updates of z that leave it inside the
+ * escape radius of 2.
+ * @tparam InteriorChecks Give points which insideCardioidOrBulb() accepts the
+ * full count without iterating them, and stop iterating any orbit which lands
+ * exactly back on an earlier z, as it can only repeat from there. The earlier z
+ * is re-saved at iterations 1, 2, 4, 8... after Brent, so cycles of any period
+ * are caught once the save interval exceeds it. Landing exactly on a value is the
+ * same in every kernel, so only the cardioid and bulb tests, rounded a little
+ * differently than the iteration, can change a count, and then only on the
+ * boundary.
+ * @note That relies on building with -ffp-contract=off, otherwise GCC fuses
+ * some of the multiplies and adds in the wider kernels into FMAs.
+ */
+template<typename Real, bool InteriorChecks = false>
+inline void mandelbrotRowScalar(const Real* const cr, const Real ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const Real four(4);
+    for(unsigned x = 0; x < count; ++x)
+    {
+        if(fractionsOut)
+        {
+            fractionsOut[x] = 0.0f;
+        }
+        if(InteriorChecks && insideCardioidOrBulb(cr[x], ci))
+        {
+            itersOut[x] = maxIters;
+            continue;
+        }
+        Real zr(0), zi(0), zr2(0), zi2(0);
+        Real savedR(0), savedI(0);
+        unsigned nextSave = 1;
+        unsigned iter = 0;
+        for(; iter < maxIters; ++iter)
+        {
+            zi = (zr + zr) * zi + ci;
+            zr = (zr2 - zi2) + cr[x];
+            zr2 = zr * zr;
+            zi2 = zi * zi;
+            const Real mag2 = zr2 + zi2;
+            if(mag2 >= four)
+            {
+                if(fractionsOut)
+                {
+                    fractionsOut[x] = escapeFraction(double(mag2));
+                }
+                break;
+            }
+            if(InteriorChecks)
+            {
+                if(zr == savedR && zi == savedI)
+                {
+                    iter = maxIters;
+                    break;
+                }
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        itersOut[x] = iter;
+    }
+}
+
+#if ASYNC_TILED_X86_SIMD
+
+// The SSE2 and AVX2 kernels below are the same code written once per vector
+// type. Active lanes hold all ones in their mask, i.e. -1 when viewed as
+// integers, so subtracting the mask counts an iteration for each of them.
+// With InteriorChecks, lanes found to be inside the set are moved from the
+// active mask to the interior one and given the full count at the end, in the
+// same places mandelbrotRowScalar() would find them.
+
+/** Four float pixels in lockstep. Escaped lanes drop out of the active mask and stop counting. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("sse2")
+inline void mandelbrotRowSSE2(const float* const cr, const float ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m128 four = _mm_set1_ps(4.0f);
+    const __m128 ciV = _mm_set1_ps(ci);
+    const __m128 ci2V = _mm_set1_ps(ci * ci);
+    const __m128i maxItersV = _mm_set1_epi32(int(maxIters));
+    unsigned x = 0;
+    for(; x + 4 <= count; x += 4)
+    {
+        const __m128 crV = _mm_loadu_ps(cr + x);
+        __m128 zr = _mm_setzero_ps(), zi = _mm_setzero_ps(), zr2 = _mm_setzero_ps(), zi2 = _mm_setzero_ps();
+        __m128 savedR = _mm_setzero_ps(), savedI = _mm_setzero_ps();
+        __m128 escapeMag2 = _mm_setzero_ps();
+        unsigned nextSave = 1;
+        __m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        __m128 interior = _mm_setzero_ps();
+        if(InteriorChecks)
+        {
+            const __m128 xq = _mm_sub_ps(crV, _mm_set1_ps(0.25f));
+            const __m128 q = _mm_add_ps(_mm_mul_ps(xq, xq), ci2V);
+            const __m128 xb = _mm_add_ps(crV, _mm_set1_ps(1.0f));
+            interior = _mm_or_ps(_mm_cmplt_ps(_mm_mul_ps(q, _mm_add_ps(q, xq)), _mm_mul_ps(_mm_set1_ps(0.25f), ci2V)),
+                                 _mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(xb, xb), ci2V), _mm_set1_ps(0.0625f)));
+            active = _mm_andnot_ps(interior, active);
+        }
+        __m128i iters = _mm_setzero_si128();
+        for(unsigned iter = 0; iter < maxIters && _mm_movemask_ps(active) != 0; ++iter)
+        {
+            zi = _mm_add_ps(_mm_mul_ps(_mm_add_ps(zr, zr), zi), ciV);
+            zr = _mm_add_ps(_mm_sub_ps(zr2, zi2), crV);
+            zr2 = _mm_mul_ps(zr, zr);
+            zi2 = _mm_mul_ps(zi, zi);
+            const __m128 mag2 = _mm_add_ps(zr2, zi2);
+            const __m128 escaped = _mm_cmpge_ps(mag2, four);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm_or_ps(escapeMag2, _mm_and_ps(_mm_and_ps(escaped, active), mag2));
+            }
+            active = _mm_andnot_ps(escaped, active);
+            iters = _mm_sub_epi32(iters, _mm_castps_si128(active));
+            if(InteriorChecks)
+            {
+                const __m128 repeated = _mm_and_ps(active, _mm_and_ps(_mm_cmpeq_ps(zr, savedR), _mm_cmpeq_ps(zi, savedI)));
+                interior = _mm_or_ps(interior, repeated);
+                active = _mm_andnot_ps(repeated, active);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        const __m128i interiorMask = _mm_castps_si128(interior);
+        iters = _mm_or_si128(_mm_and_si128(interiorMask, maxItersV), _mm_andnot_si128(interiorMask, iters));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(itersOut + x), iters);
+        if(fractionsOut)
+        {
+            alignas(16) float mags[4];
+            _mm_store_ps(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 4; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<float, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+/** Two double pixels in lockstep. The 64 bit lane masks are packed down to 32 bit counts at the end. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("sse2")
+inline void mandelbrotRowSSE2(const double* const cr, const double ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m128d four = _mm_set1_pd(4.0);
+    const __m128d ciV = _mm_set1_pd(ci);
+    const __m128d ci2V = _mm_set1_pd(ci * ci);
+    const __m128i maxItersV = _mm_set1_epi64x(maxIters);
+    unsigned x = 0;
+    for(; x + 2 <= count; x += 2)
+    {
+        const __m128d crV = _mm_loadu_pd(cr + x);
+        __m128d zr = _mm_setzero_pd(), zi = _mm_setzero_pd(), zr2 = _mm_setzero_pd(), zi2 = _mm_setzero_pd();
+        __m128d savedR = _mm_setzero_pd(), savedI = _mm_setzero_pd();
+        __m128d escapeMag2 = _mm_setzero_pd();
+        unsigned nextSave = 1;
+        __m128d active = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        __m128d interior = _mm_setzero_pd();
+        if(InteriorChecks)
+        {
+            const __m128d xq = _mm_sub_pd(crV, _mm_set1_pd(0.25));
+            const __m128d q = _mm_add_pd(_mm_mul_pd(xq, xq), ci2V);
+            const __m128d xb = _mm_add_pd(crV, _mm_set1_pd(1.0));
+            interior = _mm_or_pd(_mm_cmplt_pd(_mm_mul_pd(q, _mm_add_pd(q, xq)), _mm_mul_pd(_mm_set1_pd(0.25), ci2V)),
+                                 _mm_cmplt_pd(_mm_add_pd(_mm_mul_pd(xb, xb), ci2V), _mm_set1_pd(0.0625)));
+            active = _mm_andnot_pd(interior, active);
+        }
+        __m128i iters = _mm_setzero_si128();
+        for(unsigned iter = 0; iter < maxIters && _mm_movemask_pd(active) != 0; ++iter)
+        {
+            zi = _mm_add_pd(_mm_mul_pd(_mm_add_pd(zr, zr), zi), ciV);
+            zr = _mm_add_pd(_mm_sub_pd(zr2, zi2), crV);
+            zr2 = _mm_mul_pd(zr, zr);
+            zi2 = _mm_mul_pd(zi, zi);
+            const __m128d mag2 = _mm_add_pd(zr2, zi2);
+            const __m128d escaped = _mm_cmpge_pd(mag2, four);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm_or_pd(escapeMag2, _mm_and_pd(_mm_and_pd(escaped, active), mag2));
+            }
+            active = _mm_andnot_pd(escaped, active);
+            iters = _mm_sub_epi64(iters, _mm_castpd_si128(active));
+            if(InteriorChecks)
+            {
+                const __m128d repeated = _mm_and_pd(active, _mm_and_pd(_mm_cmpeq_pd(zr, savedR), _mm_cmpeq_pd(zi, savedI)));
+                interior = _mm_or_pd(interior, repeated);
+                active = _mm_andnot_pd(repeated, active);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        const __m128i interiorMask = _mm_castpd_si128(interior);
+        iters = _mm_or_si128(_mm_and_si128(interiorMask, maxItersV), _mm_andnot_si128(interiorMask, iters));
+        alignas(16) uint64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), iters);
+        itersOut[x] = unsigned(lanes[0]);
+        itersOut[x + 1] = unsigned(lanes[1]);
+        if(fractionsOut)
+        {
+            alignas(16) double mags[2];
+            _mm_store_pd(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 2; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<double, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+/** Eight float pixels in lockstep. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("avx2")
+inline void mandelbrotRowAVX2(const float* const cr, const float ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256 ciV = _mm256_set1_ps(ci);
+    const __m256 ci2V = _mm256_set1_ps(ci * ci);
+    const __m256i maxItersV = _mm256_set1_epi32(int(maxIters));
+    unsigned x = 0;
+    for(; x + 8 <= count; x += 8)
+    {
+        const __m256 crV = _mm256_loadu_ps(cr + x);
+        __m256 zr = _mm256_setzero_ps(), zi = _mm256_setzero_ps(), zr2 = _mm256_setzero_ps(), zi2 = _mm256_setzero_ps();
+        __m256 savedR = _mm256_setzero_ps(), savedI = _mm256_setzero_ps();
+        __m256 escapeMag2 = _mm256_setzero_ps();
+        unsigned nextSave = 1;
+        __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        __m256 interior = _mm256_setzero_ps();
+        if(InteriorChecks)
+        {
+            const __m256 xq = _mm256_sub_ps(crV, _mm256_set1_ps(0.25f));
+            const __m256 q = _mm256_add_ps(_mm256_mul_ps(xq, xq), ci2V);
+            const __m256 xb = _mm256_add_ps(crV, _mm256_set1_ps(1.0f));
+            interior = _mm256_or_ps(_mm256_cmp_ps(_mm256_mul_ps(q, _mm256_add_ps(q, xq)), _mm256_mul_ps(_mm256_set1_ps(0.25f), ci2V), _CMP_LT_OQ),
+                                    _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(xb, xb), ci2V), _mm256_set1_ps(0.0625f), _CMP_LT_OQ));
+            active = _mm256_andnot_ps(interior, active);
+        }
+        __m256i iters = _mm256_setzero_si256();
+        for(unsigned iter = 0; iter < maxIters && _mm256_movemask_ps(active) != 0; ++iter)
+        {
+            zi = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(zr, zr), zi), ciV);
+            zr = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), crV);
+            zr2 = _mm256_mul_ps(zr, zr);
+            zi2 = _mm256_mul_ps(zi, zi);
+            const __m256 mag2 = _mm256_add_ps(zr2, zi2);
+            const __m256 escaped = _mm256_cmp_ps(mag2, four, _CMP_GE_OQ);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm256_or_ps(escapeMag2, _mm256_and_ps(_mm256_and_ps(escaped, active), mag2));
+            }
+            active = _mm256_andnot_ps(escaped, active);
+            iters = _mm256_sub_epi32(iters, _mm256_castps_si256(active));
+            if(InteriorChecks)
+            {
+                const __m256 repeated = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(zr, savedR, _CMP_EQ_OQ), _mm256_cmp_ps(zi, savedI, _CMP_EQ_OQ)));
+                interior = _mm256_or_ps(interior, repeated);
+                active = _mm256_andnot_ps(repeated, active);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        iters = _mm256_blendv_epi8(iters, maxItersV, _mm256_castps_si256(interior));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(itersOut + x), iters);
+        if(fractionsOut)
+        {
+            alignas(32) float mags[8];
+            _mm256_store_ps(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 8; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<float, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+/** Four double pixels in lockstep. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("avx2")
+inline void mandelbrotRowAVX2(const double* const cr, const double ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d ciV = _mm256_set1_pd(ci);
+    const __m256d ci2V = _mm256_set1_pd(ci * ci);
+    const __m256i maxItersV = _mm256_set1_epi64x(maxIters);
+    unsigned x = 0;
+    for(; x + 4 <= count; x += 4)
+    {
+        const __m256d crV = _mm256_loadu_pd(cr + x);
+        __m256d zr = _mm256_setzero_pd(), zi = _mm256_setzero_pd(), zr2 = _mm256_setzero_pd(), zi2 = _mm256_setzero_pd();
+        __m256d savedR = _mm256_setzero_pd(), savedI = _mm256_setzero_pd();
+        __m256d escapeMag2 = _mm256_setzero_pd();
+        unsigned nextSave = 1;
+        __m256d active = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+        __m256d interior = _mm256_setzero_pd();
+        if(InteriorChecks)
+        {
+            const __m256d xq = _mm256_sub_pd(crV, _mm256_set1_pd(0.25));
+            const __m256d q = _mm256_add_pd(_mm256_mul_pd(xq, xq), ci2V);
+            const __m256d xb = _mm256_add_pd(crV, _mm256_set1_pd(1.0));
+            interior = _mm256_or_pd(_mm256_cmp_pd(_mm256_mul_pd(q, _mm256_add_pd(q, xq)), _mm256_mul_pd(_mm256_set1_pd(0.25), ci2V), _CMP_LT_OQ),
+                                    _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(xb, xb), ci2V), _mm256_set1_pd(0.0625), _CMP_LT_OQ));
+            active = _mm256_andnot_pd(interior, active);
+        }
+        __m256i iters = _mm256_setzero_si256();
+        for(unsigned iter = 0; iter < maxIters && _mm256_movemask_pd(active) != 0; ++iter)
+        {
+            zi = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zr, zr), zi), ciV);
+            zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), crV);
+            zr2 = _mm256_mul_pd(zr, zr);
+            zi2 = _mm256_mul_pd(zi, zi);
+            const __m256d mag2 = _mm256_add_pd(zr2, zi2);
+            const __m256d escaped = _mm256_cmp_pd(mag2, four, _CMP_GE_OQ);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm256_or_pd(escapeMag2, _mm256_and_pd(_mm256_and_pd(escaped, active), mag2));
+            }
+            active = _mm256_andnot_pd(escaped, active);
+            iters = _mm256_sub_epi64(iters, _mm256_castpd_si256(active));
+            if(InteriorChecks)
+            {
+                const __m256d repeated = _mm256_and_pd(active, _mm256_and_pd(_mm256_cmp_pd(zr, savedR, _CMP_EQ_OQ), _mm256_cmp_pd(zi, savedI, _CMP_EQ_OQ)));
+                interior = _mm256_or_pd(interior, repeated);
+                active = _mm256_andnot_pd(repeated, active);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        iters = _mm256_blendv_epi8(iters, maxItersV, _mm256_castpd_si256(interior));
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), iters);
+        for(unsigned lane = 0; lane < 4; ++lane)
+        {
+            itersOut[x + lane] = unsigned(lanes[lane]);
+        }
+        if(fractionsOut)
+        {
+            alignas(32) double mags[4];
+            _mm256_store_pd(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 4; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<double, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+/** Sixteen float pixels in lockstep, using mask registers for the active lanes. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("avx512f")
+inline void mandelbrotRowAVX512(const float* const cr, const float ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512 ciV = _mm512_set1_ps(ci);
+    const __m512 ci2V = _mm512_set1_ps(ci * ci);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i maxItersV = _mm512_set1_epi32(int(maxIters));
+    unsigned x = 0;
+    for(; x + 16 <= count; x += 16)
+    {
+        const __m512 crV = _mm512_loadu_ps(cr + x);
+        __m512 zr = _mm512_setzero_ps(), zi = _mm512_setzero_ps(), zr2 = _mm512_setzero_ps(), zi2 = _mm512_setzero_ps();
+        __m512 savedR = _mm512_setzero_ps(), savedI = _mm512_setzero_ps();
+        __m512 escapeMag2 = _mm512_setzero_ps();
+        unsigned nextSave = 1;
+        __mmask16 active = 0xffff;
+        __mmask16 interior = 0;
+        if(InteriorChecks)
+        {
+            const __m512 xq = _mm512_sub_ps(crV, _mm512_set1_ps(0.25f));
+            const __m512 q = _mm512_add_ps(_mm512_mul_ps(xq, xq), ci2V);
+            const __m512 xb = _mm512_add_ps(crV, _mm512_set1_ps(1.0f));
+            interior = _mm512_cmp_ps_mask(_mm512_mul_ps(q, _mm512_add_ps(q, xq)), _mm512_mul_ps(_mm512_set1_ps(0.25f), ci2V), _CMP_LT_OQ) |
+                       _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_mul_ps(xb, xb), ci2V), _mm512_set1_ps(0.0625f), _CMP_LT_OQ);
+            active = __mmask16(~interior);
+        }
+        __m512i iters = _mm512_setzero_si512();
+        for(unsigned iter = 0; iter < maxIters && active != 0; ++iter)
+        {
+            zi = _mm512_add_ps(_mm512_mul_ps(_mm512_add_ps(zr, zr), zi), ciV);
+            zr = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), crV);
+            zr2 = _mm512_mul_ps(zr, zr);
+            zi2 = _mm512_mul_ps(zi, zi);
+            const __m512 mag2 = _mm512_add_ps(zr2, zi2);
+            const __mmask16 stillInside = _mm512_mask_cmp_ps_mask(active, mag2, four, _CMP_LT_OQ);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm512_mask_mov_ps(escapeMag2, __mmask16(active & ~stillInside), mag2);
+            }
+            active = stillInside;
+            iters = _mm512_mask_add_epi32(iters, active, iters, one);
+            if(InteriorChecks)
+            {
+                const __mmask16 repeated = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(active, zr, savedR, _CMP_EQ_OQ), zi, savedI, _CMP_EQ_OQ);
+                interior |= repeated;
+                active &= __mmask16(~repeated);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        iters = _mm512_mask_mov_epi32(iters, interior, maxItersV);
+        _mm512_storeu_si512(itersOut + x, iters);
+        if(fractionsOut)
+        {
+            alignas(64) float mags[16];
+            _mm512_store_ps(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 16; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<float, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+/** Eight double pixels in lockstep, counting in a half-width integer register. */
+template<bool InteriorChecks = false>
+ASYNC_TILED_TARGET("avx512f")
+inline void mandelbrotRowAVX512(const double* const cr, const double ci, const unsigned count, const unsigned maxIters, unsigned* const itersOut, float* const fractionsOut)
+{
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d ciV = _mm512_set1_pd(ci);
+    const __m512d ci2V = _mm512_set1_pd(ci * ci);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i maxItersV = _mm512_set1_epi32(int(maxIters));
+    unsigned x = 0;
+    for(; x + 8 <= count; x += 8)
+    {
+        const __m512d crV = _mm512_loadu_pd(cr + x);
+        __m512d zr = _mm512_setzero_pd(), zi = _mm512_setzero_pd(), zr2 = _mm512_setzero_pd(), zi2 = _mm512_setzero_pd();
+        __m512d savedR = _mm512_setzero_pd(), savedI = _mm512_setzero_pd();
+        __m512d escapeMag2 = _mm512_setzero_pd();
+        unsigned nextSave = 1;
+        __mmask8 active = 0xff;
+        __mmask8 interior = 0;
+        if(InteriorChecks)
+        {
+            const __m512d xq = _mm512_sub_pd(crV, _mm512_set1_pd(0.25));
+            const __m512d q = _mm512_add_pd(_mm512_mul_pd(xq, xq), ci2V);
+            const __m512d xb = _mm512_add_pd(crV, _mm512_set1_pd(1.0));
+            interior = _mm512_cmp_pd_mask(_mm512_mul_pd(q, _mm512_add_pd(q, xq)), _mm512_mul_pd(_mm512_set1_pd(0.25), ci2V), _CMP_LT_OQ) |
+                       _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(xb, xb), ci2V), _mm512_set1_pd(0.0625), _CMP_LT_OQ);
+            active = __mmask8(~interior);
+        }
+        __m512i iters = _mm512_setzero_si512();
+        for(unsigned iter = 0; iter < maxIters && active != 0; ++iter)
+        {
+            zi = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(zr, zr), zi), ciV);
+            zr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), crV);
+            zr2 = _mm512_mul_pd(zr, zr);
+            zi2 = _mm512_mul_pd(zi, zi);
+            const __m512d mag2 = _mm512_add_pd(zr2, zi2);
+            const __mmask8 stillInside = _mm512_mask_cmp_pd_mask(active, mag2, four, _CMP_LT_OQ);
+            if(fractionsOut)
+            {
+                escapeMag2 = _mm512_mask_mov_pd(escapeMag2, __mmask8(active & ~stillInside), mag2);
+            }
+            active = stillInside;
+            iters = _mm512_mask_add_epi32(iters, __mmask16(active), iters, one);
+            if(InteriorChecks)
+            {
+                const __mmask8 repeated = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(active, zr, savedR, _CMP_EQ_OQ), zi, savedI, _CMP_EQ_OQ);
+                interior |= repeated;
+                active &= __mmask8(~repeated);
+                if(iter + 1 == nextSave)
+                {
+                    savedR = zr;
+                    savedI = zi;
+                    nextSave *= 2;
+                }
+            }
+        }
+        iters = _mm512_mask_mov_epi32(iters, __mmask16(interior), maxItersV);
+        alignas(64) unsigned lanes[16];
+        _mm512_store_si512(lanes, iters);
+        for(unsigned lane = 0; lane < 8; ++lane)
+        {
+            itersOut[x + lane] = lanes[lane];
+        }
+        if(fractionsOut)
+        {
+            alignas(64) double mags[8];
+            _mm512_store_pd(mags, escapeMag2);
+            for(unsigned lane = 0; lane < 8; ++lane)
+            {
+                fractionsOut[x + lane] = escapeFraction(mags[lane]);
+            }
+        }
+    }
+    mandelbrotRowScalar<double, InteriorChecks>(cr + x, ci, count - x, maxIters, itersOut + x, fractionsOut ? fractionsOut + x : nullptr);
+}
+
+#endif // ASYNC_TILED_X86_SIMD
+
+/**
+ * The kernels of one variant, by instruction set. Only float and double have
+ * vector versions.
+ */
+template<typename Real, bool InteriorChecks>
+struct MandelbrotRowKernels
+{
+    static MandelbrotRowFn<Real> get(const SimdLevel /*level*/)
+    {
+        return mandelbrotRowScalar<Real, InteriorChecks>;
+    }
+};
+
+template<bool InteriorChecks>
+struct MandelbrotRowKernels<float, InteriorChecks>
+{
+    static MandelbrotRowFn<float> get(const SimdLevel level)
+    {
+        switch(level) {
+#if ASYNC_TILED_X86_SIMD
+            case SimdLevel::AVX512: return mandelbrotRowAVX512<InteriorChecks>;
+            case SimdLevel::AVX2:   return mandelbrotRowAVX2<InteriorChecks>;
+            case SimdLevel::SSE2:   return mandelbrotRowSSE2<InteriorChecks>;
+#endif
+            default: return mandelbrotRowScalar<float, InteriorChecks>;
+        }
+    }
+};
+
+template<bool InteriorChecks>
+struct MandelbrotRowKernels<double, InteriorChecks>
+{
+    static MandelbrotRowFn<double> get(const SimdLevel level)
+    {
+        switch(level) {
+#if ASYNC_TILED_X86_SIMD
+            case SimdLevel::AVX512: return mandelbrotRowAVX512<InteriorChecks>;
+            case SimdLevel::AVX2:   return mandelbrotRowAVX2<InteriorChecks>;
+            case SimdLevel::SSE2:   return mandelbrotRowSSE2<InteriorChecks>;
+#endif
+            default: return mandelbrotRowScalar<double, InteriorChecks>;
+        }
+    }
+};
+
+/**
+ * @param interiorChecks Pick the variant which skips points inside the set, see
+ * mandelbrotRowScalar().
+ * @return The kernel for the given instruction set, or the scalar one if it was
+ * not compiled in or there is no vector version for this type.
+ */
+template<typename Real>
+inline MandelbrotRowFn<Real> mandelbrotRowKernel(const SimdLevel level, const bool interiorChecks = ASYNC_TILED_INTERIOR_CHECKS != 0)
+{
+    return interiorChecks ? MandelbrotRowKernels<Real, true>::get(level) : MandelbrotRowKernels<Real, false>::get(level);
+}
+
+/** The widest kernel this CPU runs for a type, picked once on first use. */
+template<typename Real>
+inline MandelbrotRowFn<Real> MandelbrotRow()
+{
+    static const MandelbrotRowFn<Real> kernel = mandelbrotRowKernel<Real>(DetectSimdLevel());
+    return kernel;
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_SIMD_KERNELS_H
@@ -0,0 +1,174 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_STAGING_RING_H
+#define ASYNC_TILED_STAGING_RING_H
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace async_tiled
+{
+
+/**
+ * A ring of fixed-size slots for pixels on their way to the GPU, allocated
+ * once up front so that staging them never touches the heap.
+ *
+ * Any number of threads acquire slots and fill them. One thread uploads from
+ * them and releases them, in any order. A slot only comes round again once
+ * every slot acquired before it has been released, so acquiring is a CAS on
+ * the head, and releasing sets a flag and moves the tail over the run of
+ * released slots at it.
+ * Several consecutive slots can be acquired as one run, to hold something
+ * bigger than a slot in one piece.
+ */
+class StagingRing
+{
+public:
+    /// Slots start on a cacheline so no two share one.
+    static constexpr size_t ALIGNMENT = 128;
+
+    /**
+     * @param slotBytes Rounded up to a multiple of ALIGNMENT.
+     * @param slots At least one.
+     */
+    StagingRing(const size_t slotBytes, const size_t slots) :
+        slotBytes_((slotBytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+        slots_(std::max<size_t>(slots, 1)),
+        storage_(new uint8_t[slotBytes_ * slots_ + ALIGNMENT]),
+        released_(new std::atomic<bool>[slots_]())
+    {
+        base_ = storage_.get() + (ALIGNMENT - reinterpret_cast<uintptr_t>(storage_.get()) % ALIGNMENT) % ALIGNMENT;
+    }
+
+    /** Slots acquired together by tryAcquireRun(). */
+    struct Run
+    {
+        /// The first slot of the run. Its bytes carry on through the rest.
+        size_t slot;
+        size_t count;
+        /// Slots left at the end of the ring as the run didn't fit there, given back with it.
+        size_t skipped;
+    };
+
+    StagingRing(const StagingRing&) = delete;
+    StagingRing& operator = (const StagingRing&) = delete;
+
+    size_t slotBytes() const { return slotBytes_; }
+    size_t slots() const { return slots_; }
+    /** The most slots tryAcquireRun() takes at once. */
+    size_t maxRun() const { return std::max<size_t>(slots_ / 2, 1); }
+
+    /**
+     * Claim the next slot to fill. Safe from any number of threads at once.
+     * @return false if every slot is waiting to be released.
+     */
+    bool tryAcquire(size_t& slot)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        do
+        {
+            // Pairs with the release in release() so the slot's last upload has finished reading it:
+            if(head - tail_.load(std::memory_order_acquire) >= slots_)
+            {
+                return false;
+            }
+        }
+        while(!head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed));
+        slot = head % slots_;
+        return true;
+    }
+
+    /**
+     * Claim count consecutive slots to fill as one. Safe from any number of threads at once.
+     * @param count No more than maxRun(), half the ring, so that the run and
+     * the slots it skips at the end of the ring always fit once it drains.
+     * @return false if not enough slots are free yet.
+     */
+    bool tryAcquireRun(const size_t count, Run& run)
+    {
+        assert(count > 0 && count <= maxRun());
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t skipped;
+        do
+        {
+            // A run can't wrap round the end of the ring, so starts again at the beginning:
+            const size_t offset = head % slots_;
+            skipped = offset + count > slots_ ? slots_ - offset : 0;
+            // Pairs with the release in release() so the slots' last uploads have finished reading them:
+            if(head + skipped + count - tail_.load(std::memory_order_acquire) > slots_)
+            {
+                return false;
+            }
+        }
+        while(!head_.compare_exchange_weak(head, head + skipped + count, std::memory_order_relaxed));
+        run = {(head + skipped) % slots_, count, skipped};
+        return true;
+    }
+
+    uint8_t* data(const size_t slot)
+    {
+        assert(slot < slots_);
+        return base_ + slot * slotBytes_;
+    }
+
+    /** Hand back a slot once its pixels are uploaded. Only from the uploading thread. */
+    void release(const size_t slot)
+    {
+        assert(slot < slots_);
+        released_[slot].store(true, std::memory_order_relaxed);
+        advanceTail();
+    }
+
+    /** Hand back a run once its pixels are uploaded. Only from the uploading thread. */
+    void release(const Run& run)
+    {
+        assert(run.slot < slots_ && run.count + run.skipped <= slots_);
+        for(size_t i = 0; i < run.skipped + run.count; ++i)
+        {
+            released_[(run.slot + slots_ - run.skipped + i) % slots_].store(true, std::memory_order_relaxed);
+        }
+        advanceTail();
+    }
+
+    /** Slots acquired and not yet released, or ones released out of order still waiting on an earlier one. */
+    size_t inUse() const
+    {
+        return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed);
+    }
+
+private:
+    /** Move the tail over the released slots at it. */
+    void advanceTail()
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        while(released_[tail % slots_].load(std::memory_order_relaxed))
+        {
+            released_[tail % slots_].store(false, std::memory_order_relaxed);
+            ++tail;
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+    const size_t slotBytes_;
+    const size_t slots_;
+    std::unique_ptr<uint8_t[]> storage_;
+    uint8_t* base_;
+    /// Per slot, whether it was released while a slot before it was still out.
+    std::unique_ptr<std::atomic<bool>[]> released_;
+    /// Positions count up forever. The slot of a position is it modulo slots_.
+    std::atomic<size_t> head_ {0};
+    /// Keeps the producers' head and the uploader's tail off each other's cacheline.
+    /// Padded rather than aligned as the ring is a member of heap objects.
+    uint8_t padding_[ALIGNMENT - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_ {0};
+};
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_STAGING_RING_H
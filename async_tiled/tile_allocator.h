@@ -0,0 +1,241 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_TILE_ALLOCATOR_H
+#define ASYNC_TILED_TILE_ALLOCATOR_H
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace async_tiled
+{
+
+/**
+ * A slab allocator of fixed-size, cacheline-aligned blocks, each big enough for
+ * the pixels of one tile.
+ *
+ * Blocks are carved out of slabs of many at a time and never given back to the
+ * heap, so once the pool has grown to the most tiles alive at once there is no
+ * more heap traffic. Each thread keeps a small cache of free blocks and only
+ * takes the pool's lock to move a batch of them to or from the shared free
+ * list.
+ * There is one pool per block size, got with forBlockSize().
+ */
+class TileBlockPool
+{
+public:
+    /// Blocks start on a cacheline so no two tiles share one.
+    static constexpr size_t ALIGNMENT = 128;
+    static constexpr unsigned BLOCKS_PER_SLAB = 64;
+    /// Blocks moved between a thread's cache and the shared free list at a time.
+    static constexpr unsigned CACHE_BATCH = 16;
+    /// Distinct block sizes with a per-thread cache. Each thread has a cache per size.
+    /// Pools for sizes past these go straight to their shared free list instead.
+    static constexpr unsigned MAX_POOLS = 8;
+
+    /** Counters for seeing how much memory tiles are taking. */
+    struct Stats
+    {
+        /// Blocks carved out of slabs so far.
+        size_t capacity;
+        /// Blocks handed out and not yet returned.
+        size_t inUse;
+        /// The most blocks ever in use at once.
+        size_t highWater;
+        size_t blockBytes;
+    };
+
+    TileBlockPool(const TileBlockPool&) = delete;
+    TileBlockPool& operator = (const TileBlockPool&) = delete;
+
+    /**
+     * The pool for blocks of at least the given size, created on first use.
+     * Pools live until the process exits so that worker threads can return
+     * blocks to them however late they shut down.
+     */
+    static TileBlockPool& forBlockSize(const size_t bytes)
+    {
+        // Most threads ask for one size over and over, so remember the last one:
+        static thread_local TileBlockPool* last = nullptr;
+        const size_t blockBytes = roundUpToAlignment(bytes);
+        if(last && last->blockBytes_ == blockBytes)
+        {
+            return *last;
+        }
+        static std::mutex registryLock;
+        static std::vector<TileBlockPool*>* const registry = new std::vector<TileBlockPool*>();
+        std::lock_guard<std::mutex> lock(registryLock);
+        for(TileBlockPool* const pool : *registry)
+        {
+            if(pool->blockBytes_ == blockBytes)
+            {
+                return *(last = pool);
+            }
+        }
+        // Sizes past the per-thread caches still get a pool, just an uncached one:
+        registry->push_back(new TileBlockPool(blockBytes, registry->size() < MAX_POOLS ? unsigned(registry->size()) : UNCACHED));
+        return *(last = registry->back());
+    }
+
+    size_t blockBytes() const { return blockBytes_; }
+
+    /** @return An uninitialised block of blockBytes(), aligned to ALIGNMENT. */
+    void* allocate()
+    {
+        void* block;
+        if(index_ == UNCACHED)
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            if(free_.empty())
+            {
+                grow();
+            }
+            block = free_.back();
+            free_.pop_back();
+        }
+        else
+        {
+            std::vector<void*>& cache = threadCache();
+            if(cache.empty())
+            {
+                refill(cache);
+            }
+            block = cache.back();
+            cache.pop_back();
+        }
+        const size_t inUse = inUse_.fetch_add(1, std::memory_order_relaxed) + 1;
+        size_t highWater = highWater_.load(std::memory_order_relaxed);
+        while(inUse > highWater && !highWater_.compare_exchange_weak(highWater, inUse, std::memory_order_relaxed))
+        {
+        }
+        return block;
+    }
+
+    /** Give back a block from allocate(), from any thread. */
+    void deallocate(void* const block)
+    {
+        assert(block);
+        if(index_ == UNCACHED)
+        {
+            {
+                std::lock_guard<std::mutex> lock(lock_);
+                free_.push_back(block);
+            }
+            inUse_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        std::vector<void*>& cache = threadCache();
+        cache.push_back(block);
+        if(cache.size() >= 2 * CACHE_BATCH)
+        {
+            flush(cache, CACHE_BATCH);
+        }
+        inUse_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    Stats stats() const
+    {
+        return {capacity_.load(std::memory_order_relaxed), inUse_.load(std::memory_order_relaxed),
+                highWater_.load(std::memory_order_relaxed), blockBytes_};
+    }
+
+private:
+    /** A thread's free blocks of each pool, handed back to them when the thread exits. */
+    struct ThreadCaches
+    {
+        ThreadCaches()
+        {
+            for(auto& blocks : caches)
+            {
+                // Room for the most a cache holds before flushing so it never reallocates:
+                blocks.reserve(2 * CACHE_BATCH);
+            }
+        }
+        ~ThreadCaches()
+        {
+            for(unsigned i = 0; i < MAX_POOLS; ++i)
+            {
+                if(pools[i])
+                {
+                    pools[i]->flush(caches[i], caches[i].size());
+                }
+            }
+        }
+        std::vector<void*> caches[MAX_POOLS];
+        TileBlockPool* pools[MAX_POOLS] = {};
+    };
+
+    /// The index_ of a pool with no per-thread caches.
+    static constexpr unsigned UNCACHED = MAX_POOLS;
+
+    TileBlockPool(const size_t blockBytes, const unsigned index) : blockBytes_(blockBytes), index_(index) {}
+
+    static constexpr size_t roundUpToAlignment(const size_t bytes)
+    {
+        return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    std::vector<void*>& threadCache()
+    {
+        assert(index_ < MAX_POOLS);
+        static thread_local ThreadCaches threadCaches;
+        threadCaches.pools[index_] = this;
+        return threadCaches.caches[index_];
+    }
+
+    /** Move a batch of blocks from the shared free list to a thread's cache, growing the pool if it is empty. */
+    void refill(std::vector<void*>& cache)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if(free_.empty())
+        {
+            grow();
+        }
+        const size_t batch = std::min<size_t>(CACHE_BATCH, free_.size());
+        cache.insert(cache.end(), free_.end() - batch, free_.end());
+        free_.resize(free_.size() - batch);
+    }
+
+    /** Carve a new slab into the shared free list. Call with lock_ held. */
+    void grow()
+    {
+        uint8_t* const slab = static_cast<uint8_t*>(::operator new(blockBytes_ * BLOCKS_PER_SLAB + ALIGNMENT));
+        slabs_.push_back(slab);
+        uint8_t* const first = slab + (ALIGNMENT - reinterpret_cast<uintptr_t>(slab) % ALIGNMENT) % ALIGNMENT;
+        free_.reserve(free_.size() + BLOCKS_PER_SLAB);
+        for(unsigned i = BLOCKS_PER_SLAB; i > 0; --i)
+        {
+            free_.push_back(first + (i - 1) * blockBytes_);
+        }
+        capacity_.fetch_add(BLOCKS_PER_SLAB, std::memory_order_relaxed);
+    }
+
+    /** Move count blocks from a thread's cache back to the shared free list. */
+    void flush(std::vector<void*>& cache, const size_t count)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        free_.insert(free_.end(), cache.end() - count, cache.end());
+        cache.resize(cache.size() - count);
+    }
+
+    const size_t blockBytes_;
+    /// Which of each thread's caches belongs to this pool, or UNCACHED.
+    const unsigned index_;
+    std::mutex lock_;
+    std::vector<void*> free_; // Guarded by lock_.
+    std::vector<uint8_t*> slabs_; // Guarded by lock_.
+    std::atomic<size_t> capacity_ {0};
+    std::atomic<size_t> inUse_ {0};
+    std::atomic<size_t> highWater_ {0};
+};
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_TILE_ALLOCATOR_H
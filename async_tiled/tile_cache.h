@@ -0,0 +1,201 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_TILE_CACHE_H
+#define ASYNC_TILED_TILE_CACHE_H
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "async_tiled.h"
+
+namespace async_tiled
+{
+
+/**
+ * Names a tile of a quadtree of tiles anchored at the origin of the plane.
+ * A tile of level n is 2^-n wide in units of level 0's tiles, so the four
+ * tiles of level n + 1 at (2x, 2y) to (2x + 1, 2y + 1) cover tile (x, y) of
+ * level n.
+ */
+struct TileKey
+{
+    int32_t level;
+    int64_t x;
+    int64_t y;
+    bool operator == (const TileKey& rhs) const { return level == rhs.level && x == rhs.x && y == rhs.y; }
+};
+
+struct TileKeyHash
+{
+    size_t operator()(const TileKey& key) const
+    {
+        // Neighbouring tiles differ in their low bits, so spread x and y out before mixing:
+        uint64_t h = uint64_t(key.x) * 0x9E3779B97F4A7C15ull;
+        h ^= uint64_t(key.y) * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+        h ^= uint64_t(uint32_t(key.level)) * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+        return size_t(h);
+    }
+};
+
+/**
+ * Finished tiles kept by their place in the world so a view which has been seen
+ * before can be shown again without iterating it.
+ * Tiles are copied in and out, each copy living in a block of the
+ * TileBlockPool for its size. When the tiles held take more than the byte
+ * budget, the least recently used ones are evicted.
+ * Safe to use from any number of threads.
+ */
+template<typename PixelType>
+class TileCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t tiles;
+        size_t bytes;
+    };
+
+    explicit TileCache(const size_t budgetBytes) : budget_(budgetBytes) {}
+    TileCache(const TileCache&) = delete;
+    TileCache& operator = (const TileCache&) = delete;
+
+    /** Change the budget, evicting straight away if it shrank. */
+    void setBudget(const size_t budgetBytes)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        budget_ = budgetBytes;
+        evictToBudget();
+    }
+
+    size_t budget() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return budget_;
+    }
+
+    /**
+     * Copy the cached pixels for a key into a tile, marking them as the most
+     * recently used.
+     * @return false, leaving the tile alone, if the key is not cached at the
+     * size of the spec.
+     */
+    bool fetch(const TileKey& key, const TileSpec& spec, Tile2D& tile)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        const auto found = index_.find(key);
+        if(found == index_.end() || found->second->dims.w != spec.w || found->second->dims.h != spec.h)
+        {
+            ++misses_;
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, found->second);
+        const PixelType* in = reinterpret_cast<const PixelType*>(found->second->tile.pixels);
+        for(unsigned y = 0; y < spec.h; ++y, in += spec.w)
+        {
+            std::memcpy(addressRow<PixelType>(spec, tile, y), in, spec.w * sizeof(PixelType));
+        }
+        ++hits_;
+        return true;
+    }
+
+    /** Keep a copy of a finished tile under a key, replacing any already there. */
+    void store(const TileKey& key, const TileSpec& spec, const Tile2D& tile)
+    {
+        // Copy outside the lock as this is most of the work:
+        OwningTile2D<PixelType> copy(0, 0, spec.w, spec.h);
+        PixelType* out = reinterpret_cast<PixelType*>(copy.pixels);
+        for(unsigned y = 0; y < spec.h; ++y, out += spec.w)
+        {
+            std::memcpy(out, addressRow<PixelType>(spec, tile, y), spec.w * sizeof(PixelType));
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        const auto found = index_.find(key);
+        if(found != index_.end())
+        {
+            bytes_ -= bytesOf(found->second->dims);
+            lru_.erase(found->second);
+            index_.erase(found);
+        }
+        lru_.push_front({key, {spec.w, spec.h}, std::move(copy)});
+        index_.emplace(key, lru_.begin());
+        bytes_ += bytesOf(lru_.front().dims);
+        evictToBudget();
+    }
+
+    /** Forget every tile, e.g. after a change of palette makes them stale. */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        index_.clear();
+        lru_.clear();
+        bytes_ = 0;
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return {hits_, misses_, evictions_, lru_.size(), bytes_};
+    }
+
+private:
+    struct Entry
+    {
+        TileKey key;
+        Dims2U dims;
+        OwningTile2D<PixelType> tile;
+    };
+
+    static size_t bytesOf(const Dims2U dims)
+    {
+        return size_t(dims.w) * dims.h * sizeof(PixelType);
+    }
+
+    /** Drop least recently used tiles until the rest fit the budget. Call with lock_ held. */
+    void evictToBudget()
+    {
+        while(bytes_ > budget_ && !lru_.empty())
+        {
+            bytes_ -= bytesOf(lru_.back().dims);
+            index_.erase(lru_.back().key);
+            lru_.pop_back();
+            ++evictions_;
+        }
+    }
+
+    mutable std::mutex lock_;
+    /// Most recently used first.
+    std::list<Entry> lru_;
+    std::unordered_map<TileKey, typename std::list<Entry>::iterator, TileKeyHash> index_;
+    size_t budget_;
+    size_t bytes_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+};
+
+/**
+ * A prefill hook for the launchers which fetches tiles from a cache, taking
+ * tile (0, 0) of the launch to be origin in the world.
+ * The cache must outlive the launch.
+ */
+template<typename PixelType>
+TilePrefill cachedTiles(TileCache<PixelType>& cache, const TileKey origin)
+{
+    return [&cache, origin](const TileSpec& spec, Tile2D& tile) -> bool
+    {
+        return cache.fetch({origin.level, origin.x + tile.x, origin.y + tile.y}, spec, tile);
+    };
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_TILE_CACHE_H
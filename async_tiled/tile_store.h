@@ -0,0 +1,477 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_TILE_STORE_H
+#define ASYNC_TILED_TILE_STORE_H
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "async_tiled.h"
+#include "palette.h"
+#include "tile_cache.h"
+
+namespace async_tiled
+{
+
+/** A fast 64 bit hash of some bytes, for checksums and keys rather than security. */
+inline uint64_t hashBytes(const void* const data, const size_t bytes, uint64_t hash = 0xCBF29CE484222325ull)
+{
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, in + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    for(; i < bytes; ++i)
+    {
+        hash = (hash ^ in[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/**
+ * Everything besides its place in the world which decides a tile's pixels, so
+ * tiles stored under other settings are never taken for current ones.
+ */
+inline uint64_t renderParamsHash(const unsigned maxIters, const PaletteLut& palette)
+{
+    uint64_t hash = hashBytes(&maxIters, sizeof(maxIters));
+    hash = hashBytes(&palette.interior, sizeof(palette.interior), hash);
+    return hashBytes(palette.entries.data(), palette.entries.size() * sizeof(RGBA), hash);
+}
+
+/**
+ * Finished tiles kept in a file between runs, so a view seen in an earlier
+ * session comes back without iterating.
+ *
+ * The file is mapped into memory and is a log of tile records, appended to
+ * and never rewritten except by compaction. Tiles are copied straight between
+ * the mapping and the framebuffer, with no read or write calls or buffers in
+ * between. The index is rebuilt by scanning the log on opening, and a record
+ * only joins the log once its commit marker is written after everything
+ * else, so a crash part way through a write loses that tile and no others.
+ * When the log reaches the file's capacity it is compacted in place, dropping
+ * the superseded records and then the oldest ones until half is free.
+ *
+ * The file is only meant to be read back on the machine that wrote it.
+ * Safe to use from any number of threads.
+ */
+template<typename PixelType>
+class TileStore
+{
+public:
+    struct Stats
+    {
+        size_t tiles;
+        /// Of the log, including superseded records.
+        size_t bytesUsed;
+        size_t capacity;
+        size_t hits;
+        size_t misses;
+        size_t compactions;
+        /// Records whose pixels were found torn, and dropped.
+        size_t corrupt;
+    };
+
+    /** A store which holds nothing until opened. */
+    TileStore() {}
+    TileStore(const std::string& path, const size_t capacityBytes)
+    {
+        open(path, capacityBytes);
+    }
+    TileStore(const TileStore&) = delete;
+    TileStore& operator = (const TileStore&) = delete;
+    ~TileStore()
+    {
+        close();
+    }
+
+    /**
+     * Map a store file, creating it if it doesn't exist, and index the tiles in it.
+     * The file is sized to the capacity straight away, sparse where the
+     * filesystem allows.
+     * @return false, leaving the store closed, if the file can't be mapped.
+     */
+    bool open(const std::string& path, const size_t capacityBytes)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        closeLocked();
+        const size_t capacity = roundUp(capacityBytes);
+        if(capacity < HEADER_BYTES + 2 * RECORD_HEADER_BYTES)
+        {
+            return false;
+        }
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd_ < 0)
+        {
+            return false;
+        }
+        void* mapping = MAP_FAILED;
+        if(::ftruncate(fd_, off_t(capacity)) == 0)
+        {
+            mapping = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        }
+        if(mapping == MAP_FAILED)
+        {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        base_ = static_cast<uint8_t*>(mapping);
+        capacity_ = capacity;
+        recover();
+        return true;
+    }
+
+    /** Write the mapping back and unmap it. */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        closeLocked();
+    }
+
+    bool isOpen() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return base_ != nullptr;
+    }
+
+    /** Start writing the mapping back to the file without waiting for it. */
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if(base_)
+        {
+            ::msync(base_, end_, MS_ASYNC);
+        }
+    }
+
+    /**
+     * Copy the stored pixels for a key into a tile.
+     * @param params From renderParamsHash(), or anything else which tells apart
+     * the settings tiles are made with.
+     * @return false, leaving the tile alone, if the key isn't stored with these
+     * params at the size of the spec.
+     */
+    bool fetch(const TileKey& key, const uint64_t params, const TileSpec& spec, Tile2D& tile)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        const auto found = index_.find({key, params});
+        if(found == index_.end() || recordAt(found->second.offset).w != spec.w || recordAt(found->second.offset).h != spec.h)
+        {
+            ++misses_;
+            return false;
+        }
+        const RecordHeader& record = recordAt(found->second.offset);
+        const uint8_t* const payload = base_ + found->second.offset + RECORD_HEADER_BYTES;
+        // The commit marker may have reached the disk before the pixels did, so they
+        // are checked the first time they're read after a restart:
+        if(!found->second.verified)
+        {
+            if(hashBytes(payload, payloadBytes(record.w, record.h)) != record.payloadCheck)
+            {
+                index_.erase(found);
+                ++corrupt_;
+                ++misses_;
+                return false;
+            }
+            found->second.verified = true;
+        }
+        const size_t rowBytes = spec.w * sizeof(PixelType);
+        for(unsigned y = 0; y < spec.h; ++y)
+        {
+            std::memcpy(addressRow<PixelType>(spec, tile, y), payload + y * rowBytes, rowBytes);
+        }
+        ++hits_;
+        return true;
+    }
+
+    /**
+     * Append a finished tile to the log, unless it is already stored, since the
+     * same key and params always give the same pixels.
+     */
+    void store(const TileKey& key, const uint64_t params, const TileSpec& spec, const Tile2D& tile)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if(!base_ || index_.count({key, params}))
+        {
+            return;
+        }
+        const size_t bytes = recordBytes(spec.w, spec.h);
+        if(!fits(bytes))
+        {
+            compact(bytes);
+            if(!fits(bytes))
+            {
+                return;
+            }
+        }
+        uint8_t* const out = base_ + end_;
+        RecordHeader& record = recordAt(end_);
+        record.marker = 0;
+        const size_t rowBytes = spec.w * sizeof(PixelType);
+        uint8_t* const payload = out + RECORD_HEADER_BYTES;
+        for(unsigned y = 0; y < spec.h; ++y)
+        {
+            std::memcpy(payload + y * rowBytes, addressRow<PixelType>(spec, tile, y), rowBytes);
+        }
+        std::memset(payload + spec.h * rowBytes, 0, bytes - RECORD_HEADER_BYTES - spec.h * rowBytes);
+        record.epoch = fileHeader().epoch;
+        record.level = key.level;
+        record.w = uint16_t(spec.w);
+        record.h = uint16_t(spec.h);
+        record.x = key.x;
+        record.y = key.y;
+        record.params = params;
+        record.payloadCheck = hashBytes(payload, payloadBytes(spec.w, spec.h));
+        record.headerCheck = headerCheck(record);
+        commit(end_, end_ + bytes);
+        index_[{key, params}] = {end_, true};
+        end_ += bytes;
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return {index_.size(), end_, capacity_, hits_, misses_, compactions_, corrupt_};
+    }
+
+private:
+    static constexpr uint64_t MAGIC = 0x45524F5453454C54ull; // "TLESTORE"
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint32_t COMMITTED = 0x54494D43u; // "CMIT"
+    static constexpr size_t HEADER_BYTES = CACHELINE_LENGTH;
+    static constexpr size_t RECORD_HEADER_BYTES = CACHELINE_LENGTH;
+
+    struct FileHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        /// The TileFormat of the pixels, so formats of the same size aren't mistaken for each other.
+        uint32_t pixelFormat;
+        /// Bumped by each compaction. Records of earlier epochs are not read.
+        uint32_t epoch;
+    };
+
+    struct RecordHeader
+    {
+        /// COMMITTED once everything else in the record is written.
+        uint32_t marker;
+        uint32_t epoch;
+        int32_t level;
+        uint16_t w;
+        uint16_t h;
+        int64_t x;
+        int64_t y;
+        uint64_t params;
+        uint64_t payloadCheck;
+        /// Of the fields above besides the marker, so a record torn by a crash isn't indexed.
+        uint64_t headerCheck;
+    };
+    static_assert(sizeof(FileHeader) <= HEADER_BYTES && sizeof(RecordHeader) <= RECORD_HEADER_BYTES, "Headers must fit their slots.");
+
+    struct StoreKey
+    {
+        TileKey tile;
+        uint64_t params;
+        bool operator == (const StoreKey& rhs) const { return tile == rhs.tile && params == rhs.params; }
+    };
+
+    struct StoreKeyHash
+    {
+        size_t operator()(const StoreKey& key) const
+        {
+            return TileKeyHash()(key.tile) ^ size_t(key.params * 0x9E3779B97F4A7C15ull);
+        }
+    };
+
+    struct Slot
+    {
+        size_t offset;
+        /// Whether the pixels have been checked against their checksum.
+        bool verified;
+    };
+
+    static constexpr size_t roundUp(const size_t bytes)
+    {
+        return (bytes + CACHELINE_LENGTH - 1) / CACHELINE_LENGTH * CACHELINE_LENGTH;
+    }
+
+    static size_t payloadBytes(const unsigned w, const unsigned h)
+    {
+        return roundUp(size_t(w) * h * sizeof(PixelType));
+    }
+
+    static size_t recordBytes(const unsigned w, const unsigned h)
+    {
+        return RECORD_HEADER_BYTES + payloadBytes(w, h);
+    }
+
+    static uint64_t headerCheck(const RecordHeader& record)
+    {
+        return hashBytes(&record.epoch, offsetof(RecordHeader, headerCheck) - offsetof(RecordHeader, epoch));
+    }
+
+    FileHeader& fileHeader() { return *reinterpret_cast<FileHeader*>(base_); }
+    RecordHeader& recordAt(const size_t offset) { return *reinterpret_cast<RecordHeader*>(base_ + offset); }
+
+    /** Whether a record of some bytes can be appended, leaving room to mark the end of the log. */
+    bool fits(const size_t bytes) const
+    {
+        return end_ + bytes + RECORD_HEADER_BYTES <= capacity_;
+    }
+
+    /**
+     * Make a written record part of the log: clear the marker after it so a
+     * stale record there can't be read as the next one, then set its own.
+     */
+    void commit(const size_t offset, const size_t next)
+    {
+        recordAt(next).marker = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        recordAt(offset).marker = COMMITTED;
+    }
+
+    /** Index the committed records of the current epoch, stopping at the first which isn't. Call with lock_ held. */
+    void recover()
+    {
+        FileHeader& header = fileHeader();
+        if(header.magic != MAGIC || header.version != VERSION || header.pixelFormat != uint32_t(PixelType::format))
+        {
+            // New, or from an incompatible build, so start afresh:
+            header.magic = MAGIC;
+            header.version = VERSION;
+            header.pixelFormat = uint32_t(PixelType::format);
+            header.epoch = 0;
+            recordAt(HEADER_BYTES).marker = 0;
+            end_ = HEADER_BYTES;
+            return;
+        }
+        size_t offset = HEADER_BYTES;
+        while(offset + RECORD_HEADER_BYTES <= capacity_)
+        {
+            const RecordHeader& record = recordAt(offset);
+            if(record.marker != COMMITTED || record.epoch != header.epoch || record.headerCheck != headerCheck(record) ||
+               offset + recordBytes(record.w, record.h) + RECORD_HEADER_BYTES > capacity_)
+            {
+                break;
+            }
+            index_[{{record.level, record.x, record.y}, record.params}] = {offset, false};
+            offset += recordBytes(record.w, record.h);
+        }
+        end_ = offset;
+    }
+
+    /**
+     * Slide the live records down over the superseded ones, dropping the oldest
+     * until there is room for a record of some bytes and half the store is free.
+     * Records are moved into the next epoch one at a time, so a crash part way
+     * through keeps those already moved. Call with lock_ held.
+     */
+    void compact(const size_t bytes)
+    {
+        ++compactions_;
+        std::vector<std::pair<size_t, StoreKey>> live;
+        live.reserve(index_.size());
+        size_t liveBytes = 0;
+        for(const auto& entry : index_)
+        {
+            live.push_back({entry.second.offset, entry.first});
+            liveBytes += recordBytes(recordAt(entry.second.offset).w, recordAt(entry.second.offset).h);
+        }
+        std::sort(live.begin(), live.end(), [](const std::pair<size_t, StoreKey>& a, const std::pair<size_t, StoreKey>& b) { return a.first < b.first; });
+        const size_t room = capacity_ - HEADER_BYTES - RECORD_HEADER_BYTES;
+        const size_t keepBytes = std::min(room / 2, room - std::min(room, bytes));
+        auto kept = live.begin();
+        for(; kept != live.end() && liveBytes > keepBytes; ++kept)
+        {
+            liveBytes -= recordBytes(recordAt(kept->first).w, recordAt(kept->first).h);
+            index_.erase(kept->second);
+        }
+
+        FileHeader& header = fileHeader();
+        ++header.epoch;
+        std::atomic_thread_fence(std::memory_order_release);
+        size_t out = HEADER_BYTES;
+        for(; kept != live.end(); ++kept)
+        {
+            RecordHeader moved = recordAt(kept->first);
+            const size_t size = recordBytes(moved.w, moved.h);
+            recordAt(out).marker = 0;
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memmove(base_ + out + RECORD_HEADER_BYTES, base_ + kept->first + RECORD_HEADER_BYTES, size - RECORD_HEADER_BYTES);
+            moved.marker = 0;
+            moved.epoch = header.epoch;
+            moved.headerCheck = headerCheck(moved);
+            recordAt(out) = moved;
+            commit(out, out + size);
+            index_[kept->second].offset = out;
+            out += size;
+        }
+        recordAt(out).marker = 0;
+        end_ = out;
+    }
+
+    void closeLocked()
+    {
+        if(base_)
+        {
+            ::msync(base_, end_, MS_ASYNC);
+            ::munmap(base_, capacity_);
+            base_ = nullptr;
+        }
+        if(fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        index_.clear();
+        end_ = 0;
+        capacity_ = 0;
+    }
+
+    mutable std::mutex lock_;
+    int fd_ = -1;
+    uint8_t* base_ = nullptr;
+    size_t capacity_ = 0;
+    /// Where the next record goes.
+    size_t end_ = 0;
+    std::unordered_map<StoreKey, Slot, StoreKeyHash> index_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t compactions_ = 0;
+    size_t corrupt_ = 0;
+};
+
+/**
+ * A prefill hook for the launchers which fetches tiles from a store, taking
+ * tile (0, 0) of the launch to be origin in the world.
+ * The store must outlive the launch.
+ */
+template<typename PixelType>
+TilePrefill storedTiles(TileStore<PixelType>& store, const TileKey origin, const uint64_t params)
+{
+    return [&store, origin, params](const TileSpec& spec, Tile2D& tile) -> bool
+    {
+        return store.fetch({origin.level, origin.x + tile.x, origin.y + tile.y}, params, spec, tile);
+    };
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_TILE_STORE_H
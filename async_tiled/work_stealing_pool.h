@@ -0,0 +1,247 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#ifndef ASYNC_TILED_WORK_STEALING_POOL_H
+#define ASYNC_TILED_WORK_STEALING_POOL_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace async_tiled
+{
+
+/**
+ * A fixed-size set of worker threads which run tasks submitted to them,
+ * handing back a std::future for each one the same way std::async does.
+ *
+ * Each worker owns a deque of tasks. A worker pops the newest task from the back
+ * of its own deque (good for cache locality when a task spawns more work) and,
+ * when its own deque runs dry, steals the oldest task from the front of another
+ * worker's deque. Submissions from outside the pool are dealt round-robin across
+ * the workers.
+ *
+ * @note Blocking on the future of a pooled task from inside another pooled task
+ * can deadlock once every worker is doing it. Launcher / waiter tasks which sit on
+ * futures should keep using LaunchAsync().
+ */
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(unsigned numWorkers = DefaultWorkerCount()) :
+        workers_(numWorkers > 0 ? numWorkers : 1u)
+    {
+        threads_.reserve(workers_.size());
+        for(unsigned i = 0; i < workers_.size(); ++i)
+        {
+            threads_.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    /** Runs any tasks still queued then joins all the worker threads. */
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepLock_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for(auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+
+    /** One worker per hardware thread. */
+    static unsigned DefaultWorkerCount()
+    {
+        const unsigned hardwareThreads = std::thread::hardware_concurrency();
+        return hardwareThreads > 0 ? hardwareThreads : 1u;
+    }
+
+    unsigned size() const { return unsigned(workers_.size()); }
+
+    /**
+     * Queue a function to be called on one of the workers.
+     * Arguments are decay-copied just like std::async, so use std::ref to pass
+     * references.
+     * @return A future for whatever fn returns.
+     */
+    template<typename Fn, typename... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submit(Fn&& fn, Args&&... args)
+    {
+        using Result = typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type;
+        using TaskType = BoundTask<Result, typename std::decay<Fn>::type, typename std::decay<Args>::type...>;
+        std::unique_ptr<TaskType> task(new TaskType(std::forward<Fn>(fn), std::forward<Args>(args)...));
+        std::future<Result> result = task->promise.get_future();
+        push(std::move(task));
+        return result;
+    }
+
+private:
+    /** Type-erased unit of work held in the worker deques. */
+    struct Task
+    {
+        virtual ~Task() {}
+        virtual void run() = 0;
+    };
+
+    template<typename Result, typename Fn, typename... Args>
+    struct BoundTask : public Task
+    {
+        template<typename F, typename... A>
+        BoundTask(F&& fn, A&&... args) : fn(std::forward<F>(fn)), args(std::forward<A>(args)...) {}
+
+        void run() override
+        {
+            try
+            {
+                invoke(std::integral_constant<bool, std::is_void<Result>::value>(), std::index_sequence_for<Args...>());
+            }
+            catch(...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+        }
+
+        template<std::size_t... I>
+        void invoke(std::false_type /* void result */, std::index_sequence<I...>)
+        {
+            promise.set_value(fn(std::move(std::get<I>(args))...));
+        }
+        template<std::size_t... I>
+        void invoke(std::true_type /* void result */, std::index_sequence<I...>)
+        {
+            fn(std::move(std::get<I>(args))...);
+            promise.set_value();
+        }
+
+        Fn fn;
+        std::tuple<Args...> args;
+        std::promise<Result> promise;
+    };
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<std::unique_ptr<Task>> tasks;
+    };
+
+    /** Identifies the pool and worker index of the calling thread, if it is a worker. */
+    struct ThisThread
+    {
+        const WorkStealingPool* pool;
+        unsigned index;
+    };
+    static ThisThread& thisThread()
+    {
+        static thread_local ThisThread self = {nullptr, 0};
+        return self;
+    }
+
+    void push(std::unique_ptr<Task> task)
+    {
+        // Tasks spawned on a worker stay local to it, others are dealt out:
+        const ThisThread& self = thisThread();
+        const unsigned index = self.pool == this ? self.index : nextWorker_.fetch_add(1u, std::memory_order_relaxed) % size();
+        {
+            std::lock_guard<std::mutex> lock(workers_[index].lock);
+            workers_[index].tasks.push_back(std::move(task));
+        }
+        pending_.fetch_add(1);
+        // Only touch the sleep lock if somebody might be sleeping on it:
+        if(sleepers_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepLock_);
+            wake_.notify_one();
+        }
+    }
+
+    std::unique_ptr<Task> pop(const unsigned index)
+    {
+        std::unique_ptr<Task> task;
+        // Own work first, newest first:
+        {
+            Worker& own = workers_[index];
+            std::lock_guard<std::mutex> lock(own.lock);
+            if(!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+        // Steal the oldest work of the others:
+        for(unsigned i = 1; i < size(); ++i)
+        {
+            Worker& victim = workers_[(index + i) % size()];
+            std::lock_guard<std::mutex> lock(victim.lock);
+            if(!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+        return task;
+    }
+
+    void workerLoop(const unsigned index)
+    {
+        thisThread() = {this, index};
+        for(;;)
+        {
+            if(std::unique_ptr<Task> task = pop(index))
+            {
+                pending_.fetch_sub(1);
+                task->run();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepLock_);
+            ++sleepers_;
+            wake_.wait(lock, [this]() { return pending_.load() > 0 || stopping_; });
+            --sleepers_;
+            if(stopping_ && pending_.load() <= 0)
+            {
+                break;
+            }
+        }
+    }
+
+    std::vector<Worker> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<unsigned> nextWorker_ {0};
+    /// Count of queued tasks. Can dip below zero briefly as it is bumped after the push.
+    std::atomic<int> pending_ {0};
+    std::atomic<int> sleepers_ {0};
+    std::mutex sleepLock_;
+    std::condition_variable wake_;
+    bool stopping_ = false; // Guarded by sleepLock_.
+};
+
+/**
+ * The pool shared by all tile launches in the process, created on first use and
+ * sized to the hardware.
+ */
+inline WorkStealingPool& TilePool()
+{
+    static WorkStealingPool pool;
+    return pool;
+}
+
+} // namespace async_tiled
+
+#endif // ASYNC_TILED_WORK_STEALING_POOL_H